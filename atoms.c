@@ -20,8 +20,13 @@ struct atoms {
 	int frame;
 	int nframes;
 	int natoms;
+	int natomalloc;         /* room for atoms in each frame */
+	int nframealloc;        /* room for frames */
 	int *type;
-	vec_t *xyz;
+	vec_t *xyz;             /* frames natomalloc apart */
+	vec_t *cell;    /* three unit cell vectors per frame, zero if none */
+	version_t version;      /* atom count and types */
+	version_t *xyzversion;  /* coordinates and cell of each frame */
 };
 
 static const char *elementnames[] = {
@@ -50,33 +55,83 @@ atoms_name_to_type(const char *name)
 	return (0);
 }
 
-struct atoms *
-atoms_create(void)
+static void
+touch_frames(struct atoms *atoms)
 {
-	struct atoms *atoms;
+	int i;
 
-	atoms = xcalloc(1, sizeof *atoms);
-	atoms->nframes = 1;
+	for (i = 0; i < atoms->nframes; i++)
+		atoms->xyzversion[i] = util_next_version();
+}
 
-	return (atoms);
+static vec_t *
+frame_xyz(struct atoms *atoms, int frame)
+{
+	return (atoms->xyz + (size_t)frame * atoms->natomalloc);
+}
+
+/* make room for n atoms in every frame, moving frames apart if needed */
+static void
+grow_atoms(struct atoms *atoms, int n)
+{
+	vec_t *xyz;
+	int i, nalloc;
+
+	if (n <= atoms->natomalloc)
+		return;
+
+	nalloc = atoms->natomalloc < 8 ? 8 : atoms->natomalloc;
+	while (nalloc < n)
+		nalloc *= 2;
+
+	atoms->type = xrealloc(atoms->type, nalloc * sizeof *atoms->type);
+	xyz = xcalloc((size_t)nalloc * atoms->nframealloc, sizeof *xyz);
+	/* there are no coordinates to move before the first atoms */
+	if (atoms->xyz != NULL)
+		for (i = 0; i < atoms->nframes; i++)
+			memcpy(xyz + (size_t)i * nalloc, frame_xyz(atoms, i),
+			    atoms->natoms * sizeof *xyz);
+	free(atoms->xyz);
+	atoms->xyz = xyz;
+	atoms->natomalloc = nalloc;
+}
+
+/* make room for n frames */
+static void
+grow_frames(struct atoms *atoms, int n)
+{
+	int nalloc;
+
+	if (n <= atoms->nframealloc)
+		return;
+
+	nalloc = atoms->nframealloc < 1 ? 1 : atoms->nframealloc;
+	while (nalloc < n)
+		nalloc *= 2;
+
+	if (atoms->natomalloc > 0)
+		atoms->xyz = xrealloc(atoms->xyz,
+		    (size_t)nalloc * atoms->natomalloc * sizeof *atoms->xyz);
+	atoms->cell = xrealloc(atoms->cell, 3 * nalloc * sizeof *atoms->cell);
+	atoms->xyzversion = xrealloc(atoms->xyzversion,
+	    nalloc * sizeof *atoms->xyzversion);
+	atoms->nframealloc = nalloc;
 }
 
 struct atoms *
-atoms_copy(struct atoms *atoms)
+atoms_create(void)
 {
-	struct atoms *copy;
+	struct atoms *atoms;
 
-	copy = xcalloc(1, sizeof *copy);
-	copy->natoms = atoms->natoms;
-	copy->nframes = atoms->nframes;
-	copy->frame = atoms->frame;
-	copy->type = xcalloc(copy->natoms, sizeof *copy->type);
-	memcpy(copy->type, atoms->type, copy->natoms * sizeof *copy->type);
-	copy->xyz = xcalloc(copy->natoms * copy->nframes, sizeof *copy->xyz);
-	memcpy(copy->xyz, atoms->xyz, copy->natoms * copy->nframes *
-	    sizeof *copy->xyz);
+	atoms = xcalloc(1, sizeof *atoms);
+	atoms->nframes = 1;
+	atoms->nframealloc = 1;
+	atoms->cell = xcalloc(3, sizeof *atoms->cell);
+	atoms->xyzversion = xcalloc(1, sizeof *atoms->xyzversion);
+	atoms->version = util_next_version();
+	touch_frames(atoms);
 
-	return (copy);
+	return (atoms);
 }
 
 void
@@ -85,6 +140,8 @@ atoms_free(struct atoms *atoms)
 	if (atoms) {
 		free(atoms->type);
 		free(atoms->xyz);
+		free(atoms->cell);
+		free(atoms->xyzversion);
 		free(atoms);
 	}
 }
@@ -111,60 +168,133 @@ atoms_get_frame_count(struct atoms *atoms)
 	return (atoms->nframes);
 }
 
+void
+atoms_reserve(struct atoms *atoms, int natoms, int nframes)
+{
+	grow_frames(atoms, nframes);
+	grow_atoms(atoms, natoms);
+}
+
 void
 atoms_add_frame(struct atoms *atoms)
 {
+	int frame;
+
+	grow_frames(atoms, atoms->nframes + 1);
+	frame = atoms->frame;
+
+	memmove(frame_xyz(atoms, frame + 1), frame_xyz(atoms, frame),
+	    (size_t)(atoms->nframes - frame) * atoms->natomalloc *
+	    sizeof *atoms->xyz);
+	memmove(atoms->cell + 3 * (frame + 1), atoms->cell + 3 * frame,
+	    3 * (atoms->nframes - frame) * sizeof *atoms->cell);
+	memmove(atoms->xyzversion + frame + 2, atoms->xyzversion + frame + 1,
+	    (atoms->nframes - frame - 1) * sizeof *atoms->xyzversion);
 	atoms->nframes++;
-	atoms->xyz = xrealloc(atoms->xyz,
-	    atoms->natoms * atoms->nframes * sizeof *atoms->xyz);
-
-	if (atoms->frame < atoms->nframes - 2) {
-		memmove(atoms->xyz + atoms->natoms * (atoms->frame + 2),
-		    atoms->xyz + atoms->natoms * (atoms->frame + 1),
-		    atoms->natoms * (atoms->nframes - 2 - atoms->frame) *
-		    sizeof *atoms->xyz);
-	}
-	memcpy(atoms->xyz + atoms->natoms * (atoms->frame + 1),
-	    atoms->xyz + atoms->natoms * atoms->frame,
-	    atoms->natoms * sizeof *atoms->xyz);
 	atoms->frame++;
+	atoms->xyzversion[atoms->frame] = util_next_version();
 }
 
 void
 atoms_add(struct atoms *atoms, const char *name, vec_t xyz)
+{
+	atoms_add_many(atoms, 1, &name, &xyz);
+}
+
+/* add n atoms at the same place in all frames */
+void
+atoms_add_many(struct atoms *atoms, int n, const char **names,
+    const vec_t *xyz)
 {
 	int i, j;
 
-	atoms->natoms++;
-	atoms->type = xrealloc(atoms->type,
-	    atoms->natoms * sizeof *atoms->type);
-	atoms->type[atoms->natoms - 1] = atoms_name_to_type(name);
-	atoms->xyz = xrealloc(atoms->xyz,
-	    atoms->natoms * atoms->nframes * sizeof *atoms->xyz);
-
-	i = (atoms->natoms - 1) * atoms->nframes - 1;
-	j = atoms->natoms * atoms->nframes - 1;
-	while (j >= 0) {
-		if (j % atoms->natoms == atoms->natoms - 1)
-			atoms->xyz[j--] = xyz;
-		else
-			atoms->xyz[j--] = atoms->xyz[i--];
-	}
+	grow_atoms(atoms, atoms->natoms + n);
+
+	for (i = 0; i < n; i++)
+		atoms->type[atoms->natoms + i] = atoms_name_to_type(names[i]);
+	for (j = 0; j < atoms->nframes; j++)
+		memcpy(frame_xyz(atoms, j) + atoms->natoms, xyz,
+		    n * sizeof *xyz);
+	atoms->natoms += n;
+	atoms->version = util_next_version();
+	touch_frames(atoms);
 }
 
 void
 atoms_remove(struct atoms *atoms, int idx)
 {
-	int i, j;
+	vec_t *xyz;
+	int i, n;
 
 	assert(idx >= 0 && idx < atoms_get_count(atoms));
 
-	for (i = idx; i < atoms->natoms - 1; i++)
-		atoms->type[i] = atoms->type[i + 1];
-	for (i = 0, j = 0; i < atoms->natoms * atoms->nframes; i++)
-		if (i % atoms->natoms != idx)
-			atoms->xyz[j++] = atoms->xyz[i];
+	n = atoms->natoms - idx - 1;
+	memmove(atoms->type + idx, atoms->type + idx + 1,
+	    n * sizeof *atoms->type);
+	for (i = 0; i < atoms->nframes; i++) {
+		xyz = frame_xyz(atoms, i);
+		memmove(xyz + idx, xyz + idx + 1, n * sizeof *xyz);
+	}
 	atoms->natoms--;
+	atoms->version = util_next_version();
+	touch_frames(atoms);
+}
+
+/*
+ * Remove many atoms at once.  The map gives the new index of each atom
+ * or -1 for atoms to remove, kept atoms must keep their order.
+ */
+void
+atoms_remove_many(struct atoms *atoms, const int *map)
+{
+	vec_t *xyz;
+	int i, j, n;
+
+	for (i = 0, n = 0; i < atoms->natoms; i++)
+		if (map[i] != -1)
+			atoms->type[n++] = atoms->type[i];
+	for (j = 0; j < atoms->nframes; j++) {
+		xyz = frame_xyz(atoms, j);
+		for (i = 0; i < atoms->natoms; i++)
+			if (map[i] != -1)
+				xyz[map[i]] = xyz[i];
+	}
+	atoms->natoms = n;
+	atoms->version = util_next_version();
+	touch_frames(atoms);
+}
+
+/*
+ * Insert atoms, the opposite of atoms_remove_many.  The map gives the new
+ * index of each existing atom, n is the new number of atoms.  Inserted
+ * atoms have no name and zero coordinates until they are set.
+ */
+void
+atoms_insert_many(struct atoms *atoms, int n, const int *map)
+{
+	vec_t *xyz;
+	int i, j, k;
+
+	grow_atoms(atoms, n);
+
+	for (i = n - 1, k = atoms->natoms - 1; i >= 0; i--) {
+		if (k >= 0 && map[k] == i)
+			atoms->type[i] = atoms->type[k--];
+		else
+			atoms->type[i] = 0;
+	}
+	for (j = 0; j < atoms->nframes; j++) {
+		xyz = frame_xyz(atoms, j);
+		for (i = n - 1, k = atoms->natoms - 1; i >= 0; i--) {
+			if (k >= 0 && map[k] == i)
+				xyz[i] = xyz[k--];
+			else
+				xyz[i] = vec_zero();
+		}
+	}
+	atoms->natoms = n;
+	atoms->version = util_next_version();
+	touch_frames(atoms);
 }
 
 void
@@ -173,10 +303,18 @@ atoms_clear(struct atoms *atoms)
 	atoms->natoms = 0;
 	atoms->nframes = 1;
 	atoms->frame = 0;
+	atoms->natomalloc = 0;
+	atoms->nframealloc = 1;
 	free(atoms->type);
 	atoms->type = NULL;
 	free(atoms->xyz);
 	atoms->xyz = NULL;
+	atoms->cell = xrealloc(atoms->cell, 3 * sizeof *atoms->cell);
+	memset(atoms->cell, 0, 3 * sizeof *atoms->cell);
+	atoms->xyzversion = xrealloc(atoms->xyzversion,
+	    sizeof *atoms->xyzversion);
+	atoms->version = util_next_version();
+	touch_frames(atoms);
 }
 
 int
@@ -207,6 +345,7 @@ atoms_set_name(struct atoms *atoms, int idx, const char *name)
 	assert(idx >= 0 && idx < atoms_get_count(atoms));
 
 	atoms->type[idx] = atoms_name_to_type(name);
+	atoms->version = util_next_version();
 }
 
 vec_t
@@ -214,7 +353,7 @@ atoms_get_xyz(struct atoms *atoms, int idx)
 {
 	assert(idx >= 0 && idx < atoms_get_count(atoms));
 
-	return (atoms->xyz[atoms->frame * atoms->natoms + idx]);
+	return (frame_xyz(atoms, atoms->frame)[idx]);
 }
 
 void
@@ -222,5 +361,53 @@ atoms_set_xyz(struct atoms *atoms, int idx, vec_t xyz)
 {
 	assert(idx >= 0 && idx < atoms_get_count(atoms));
 
-	atoms->xyz[atoms->frame * atoms->natoms + idx] = xyz;
+	frame_xyz(atoms, atoms->frame)[idx] = xyz;
+	atoms->xyzversion[atoms->frame] = util_next_version();
+}
+
+int
+atoms_get_cell(struct atoms *atoms, vec_t *abc)
+{
+	vec_t *cell, bc;
+
+	cell = atoms->cell + 3 * atoms->frame;
+	bc = vec_cross(&cell[1], &cell[2]);
+
+	/* no cell or a degenerate one */
+	if (fabs(vec_dot(&cell[0], &bc)) < 1.0e-6)
+		return (0);
+
+	abc[0] = cell[0];
+	abc[1] = cell[1];
+	abc[2] = cell[2];
+	return (1);
+}
+
+void
+atoms_set_cell(struct atoms *atoms, const vec_t *abc)
+{
+	vec_t *cell;
+
+	cell = atoms->cell + 3 * atoms->frame;
+	atoms->xyzversion[atoms->frame] = util_next_version();
+
+	if (abc == NULL) {
+		cell[0] = cell[1] = cell[2] = vec_zero();
+		return;
+	}
+	cell[0] = abc[0];
+	cell[1] = abc[1];
+	cell[2] = abc[2];
+}
+
+version_t
+atoms_get_version(struct atoms *atoms)
+{
+	return (atoms->version);
+}
+
+version_t
+atoms_get_xyz_version(struct atoms *atoms)
+{
+	return (atoms->xyzversion[atoms->frame]);
 }
@@ -16,11 +16,16 @@
 
 #include "vimol.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct camera {
 	mat_t rotation;
 	vec_t translation;
 	double scale;       /* pixels per angstrom */
 	double radius;      /* visible radius */
+	version_t version;
 };
 
 struct camera *
@@ -47,6 +52,7 @@ camera_reset(struct camera *camera)
 	camera->translation = vec_zero();
 	camera->scale = 50.0;
 	camera->radius = 10.0;
+	camera->version = util_next_version();
 }
 
 void
@@ -55,6 +61,7 @@ camera_move(struct camera *camera, vec_t xyz)
 	camera->translation.x += xyz.x * camera->radius;
 	camera->translation.y += xyz.y * camera->radius;
 	camera->translation.z += xyz.z * camera->radius;
+	camera->version = util_next_version();
 }
 
 void
@@ -62,6 +69,7 @@ camera_move_to(struct camera *camera, vec_t xyz)
 {
 	camera->translation = mat_vec(&camera->rotation, &xyz);
 	vec_scale(&camera->translation, -1.0);
+	camera->version = util_next_version();
 }
 
 void
@@ -80,6 +88,7 @@ camera_rotate(struct camera *camera, vec_t xyz)
 	rotmat = mat_rotation_z(xyz.z);
 	camera->rotation = mat_mat(&rotmat, &camera->rotation);
 	camera->translation = mat_vec(&rotmat, &camera->translation);
+	camera->version = util_next_version();
 }
 
 mat_t
@@ -91,8 +100,10 @@ camera_get_rotation(struct camera *camera)
 void
 camera_set_scale(struct camera *camera, double scale)
 {
-	if (scale > 0.0)
+	if (scale > 0.0) {
 		camera->scale = scale;
+		camera->version = util_next_version();
+	}
 }
 
 double
@@ -104,8 +115,10 @@ camera_get_scale(struct camera *camera)
 void
 camera_set_radius(struct camera *camera, double radius)
 {
-	if (radius > 0.01 && radius < 160.0) /* font breaks on small zoom */
+	if (radius > 0.01 && radius < 160.0) { /* font breaks on small zoom */
 		camera->radius = radius;
+		camera->version = util_next_version();
+	}
 }
 
 double
@@ -114,6 +127,12 @@ camera_get_radius(struct camera *camera)
 	return (camera->radius);
 }
 
+version_t
+camera_get_version(struct camera *camera)
+{
+	return (camera->version);
+}
+
 double
 camera_get_zoom(struct camera *camera, int width, int height)
 {
@@ -138,3 +157,51 @@ camera_transform(struct camera *camera, vec_t xyz)
 
 	return (point);
 }
+
+/*
+ * Transform many points at once.  Screen coordinates and depth go to
+ * separate arrays; depth grows away from the viewer.
+ */
+void
+camera_transform_many(struct camera *camera, int n, const vec_t *xyz,
+    double *x, double *y, double *z)
+{
+	const mat_t *r = &camera->rotation;
+	const vec_t *t = &camera->translation;
+	double s = camera->scale;
+	int i = 0;
+#if defined(__SSE2__)
+	__m128d a, b, vx, vy, vz;
+
+	for (; i + 2 <= n; i += 2) {
+		a = _mm_loadu_pd(&xyz[i].x);
+		b = _mm_loadu_pd(&xyz[i + 1].x);
+		vx = _mm_unpacklo_pd(a, b);
+		vy = _mm_unpackhi_pd(a, b);
+		vz = _mm_set_pd(xyz[i + 1].z, xyz[i].z);
+		_mm_storeu_pd(x + i, _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+		    _mm_add_pd(_mm_mul_pd(_mm_set1_pd(r->xx), vx),
+		    _mm_mul_pd(_mm_set1_pd(r->xy), vy)),
+		    _mm_mul_pd(_mm_set1_pd(r->xz), vz)),
+		    _mm_set1_pd(t->x)), _mm_set1_pd(s)));
+		_mm_storeu_pd(y + i, _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+		    _mm_add_pd(_mm_mul_pd(_mm_set1_pd(r->yx), vx),
+		    _mm_mul_pd(_mm_set1_pd(r->yy), vy)),
+		    _mm_mul_pd(_mm_set1_pd(r->yz), vz)),
+		    _mm_set1_pd(t->y)), _mm_set1_pd(s)));
+		_mm_storeu_pd(z + i, _mm_mul_pd(_mm_add_pd(_mm_add_pd(
+		    _mm_add_pd(_mm_mul_pd(_mm_set1_pd(r->zx), vx),
+		    _mm_mul_pd(_mm_set1_pd(r->zy), vy)),
+		    _mm_mul_pd(_mm_set1_pd(r->zz), vz)),
+		    _mm_set1_pd(t->z)), _mm_set1_pd(s)));
+	}
+#endif
+	for (; i < n; i++) {
+		x[i] = (r->xx * xyz[i].x + r->xy * xyz[i].y +
+		    r->xz * xyz[i].z + t->x) * s;
+		y[i] = (r->yx * xyz[i].x + r->yy * xyz[i].y +
+		    r->yz * xyz[i].z + t->y) * s;
+		z[i] = (r->zx * xyz[i].x + r->zy * xyz[i].y +
+		    r->zz * xyz[i].z + t->z) * s;
+	}
+}
@@ -176,13 +176,14 @@ fn_bond(struct tokq *args, struct state *state)
 	sel_iter_start(sel);
 	sel_iter_next(sel, &a);
 	sel_iter_next(sel, &b);
+	view_snapshot(view);
 	if ((edge = graph_edge_find(graph, a, b)) == NULL)
 		graph_edge_create(graph, a, b, 1);
 	else {
 		if ((type = graph_edge_get_type(edge)) == 3)
 			graph_edge_remove(graph, a, b);
 		else
-			graph_edge_set_type(edge, type+1);
+			graph_edge_set_type(graph, edge, type+1);
 	}
 	sel_free(sel);
 	return (1);
@@ -268,8 +269,6 @@ fn_delete(struct tokq *args, struct state *state)
 {
 	struct view *view = state_get_view(state);
 	struct sel *sel;
-	struct sys *sys;
-	int i;
 
 	sel = make_sel(args, 0, tokq_count(args), state);
 	if (sel_get_count(sel) == 0) {
@@ -277,10 +276,7 @@ fn_delete(struct tokq *args, struct state *state)
 		return (1);
 	}
 	view_snapshot(view);
-	sys = view_get_sys(view);
-	for (i = sys_get_atom_count(sys) - 1; i >= 0; i--)
-		if (sel_selected(sel, i))
-			sys_remove_atom(sys, i);
+	sys_remove_atoms(view_get_sys(view), sel);
 	error_set("deleted %d atoms", sel_get_count(sel));
 	sel_free(sel);
 	return (1);
@@ -651,6 +647,7 @@ fn_reset_bonds(struct tokq *args __unused, struct state *state)
 {
 	struct view *view = state_get_view(state);
 
+	view_snapshot(view);
 	sys_reset_bonds(view_get_sys(view));
 
 	return (1);
@@ -809,10 +806,10 @@ fn_select_within(struct tokq *args, struct state *state)
 	struct sys *sys;
 	struct sel *visible;
 	struct sel *sel;
+	struct sel *near;
 	struct spi *spi;
-	struct pair pair;
 	double radius = 4.0;
-	int idx, npairs;
+	int idx;
 
 	if (tokq_count(args) > 0) {
 		radius = tok_double(tokq_tok(args, 0));
@@ -823,28 +820,65 @@ fn_select_within(struct tokq *args, struct state *state)
 	}
 	sys = view_get_sys(view);
 	visible = view_get_visible(view);
-	spi = spi_create();
-	for (idx = 0; idx < sys_get_atom_count(sys); idx++)
-		spi_add_point(spi, sys_get_atom_xyz(sys, idx));
-	spi_compute(spi, radius);
-	npairs = spi_get_pair_count(spi);
+	spi = sys_get_spi(sys);
 	sel = make_sel(args, 1, tokq_count(args), state);
+	near = sel_create(sys_get_atom_count(sys));
+	/* atoms of sel come first, as they did with the pair search */
 	sel_iter_start(sel);
-	while (sel_iter_next(sel, &idx))
+	while (sel_iter_next(sel, &idx)) {
+		if (!sel_selected(visible, idx))
+			continue;
+		sel_add(view_get_sel(view), idx);
+		spi_query_radius(spi, sys_get_atom_xyz(sys, idx), radius, near);
+	}
+	sel_iter_start(near);
+	while (sel_iter_next(near, &idx))
 		if (sel_selected(visible, idx))
 			sel_add(view_get_sel(view), idx);
-	for (idx = 0; idx < npairs; idx++) {
-		pair = spi_get_pair(spi, idx);
-		if (!sel_selected(visible, pair.i) ||
-		    !sel_selected(visible, pair.j))
-			continue;
-		if (sel_selected(sel, pair.i) || sel_selected(sel, pair.j)) {
-			sel_add(view_get_sel(view), pair.i);
-			sel_add(view_get_sel(view), pair.j);
+	sel_free(near);
+	sel_free(sel);
+	return (1);
+}
+
+static int
+fn_select_nearest(struct tokq *args, struct state *state)
+{
+	struct view *view = state_get_view(state);
+	struct sys *sys;
+	struct sel *visible;
+	struct sel *sel;
+	struct spi *spi;
+	int i, idx, n = 1, count, *near;
+
+	if (tokq_count(args) > 0) {
+		n = tok_int(tokq_tok(args, 0));
+		if (n < 1) {
+			error_set("specify a positive number");
+			return (0);
 		}
 	}
+	sys = view_get_sys(view);
+	/* there are no more atoms to find than the others */
+	if (n >= sys_get_atom_count(sys))
+		n = sys_get_atom_count(sys) > 1 ?
+		    sys_get_atom_count(sys) - 1 : 1;
+	visible = view_get_visible(view);
+	spi = sys_get_spi(sys);
+	sel = make_sel(args, 1, tokq_count(args), state);
+	near = xcalloc(n + 1, sizeof *near);
+	sel_iter_start(sel);
+	while (sel_iter_next(sel, &idx)) {
+		if (!sel_selected(visible, idx))
+			continue;
+		/* the atom itself is the nearest one */
+		count = spi_query_nearest(spi, sys_get_atom_xyz(sys, idx),
+		    n + 1, near);
+		for (i = 0; i < count; i++)
+			if (sel_selected(visible, near[i]))
+				sel_add(view_get_sel(view), near[i]);
+	}
+	free(near);
 	sel_free(sel);
-	spi_free(spi);
 	return (1);
 }
 
@@ -1188,6 +1222,7 @@ static const struct node {
 	{ "select-connected", fn_select_connected },
 	{ "select-element", fn_select_element },
 	{ "select-molecule", fn_select_molecule },
+	{ "select-nearest", fn_select_nearest },
 	{ "select-water", fn_select_water },
 	{ "select-within", fn_select_within },
 	{ "select-x", fn_select_x },
@@ -18,15 +18,88 @@
 
 #define PDBFMT "ATOM  %5d%3s                %8.3lf%8.3lf%8.3lf"
 #define XYZFMT "%-4s %11.6lf %11.6lf %11.6lf"
+#define CRYSTFMT "CRYST1%9.3lf%9.3lf%9.3lf%7.2lf%7.2lf%7.2lf P 1           1"
+#define LATTICEFMT "Lattice=\"%.6lf %.6lf %.6lf %.6lf %.6lf %.6lf %.6lf %.6lf %.6lf\""
+
+static int
+parse_cryst1(const char *buf, vec_t *abc)
+{
+	double a, b, c, alpha, beta, gamma, cx, cy, cz;
+
+	if (sscanf(buf + 6, "%lf%lf%lf%lf%lf%lf", &a, &b, &c,
+	    &alpha, &beta, &gamma) != 6)
+		return (0);
+	/* 1 1 1 is a placeholder for structures without a cell */
+	if (a <= 1.0 || b <= 1.0 || c <= 1.0 ||
+	    alpha <= 0.0 || beta <= 0.0 || gamma <= 0.0 ||
+	    alpha >= 180.0 || beta >= 180.0 || gamma >= 180.0)
+		return (0);
+
+	alpha *= PI / 180.0;
+	beta *= PI / 180.0;
+	gamma *= PI / 180.0;
+
+	cx = cos(beta);
+	cy = (cos(alpha) - cos(beta) * cos(gamma)) / sin(gamma);
+	cz = 1.0 - cx * cx - cy * cy;
+
+	if (cz <= 0.0)
+		return (0);
+
+	abc[0] = vec_new(a, 0, 0);
+	abc[1] = vec_new(b * cos(gamma), b * sin(gamma), 0);
+	abc[2] = vec_new(c * cx, c * cy, c * sqrt(cz));
+	return (1);
+}
+
+static void
+write_cryst1(const vec_t *abc, FILE *fp)
+{
+	double a, b, c, alpha, beta, gamma;
+
+	a = vec_len(&abc[0]);
+	b = vec_len(&abc[1]);
+	c = vec_len(&abc[2]);
+	alpha = acos(vec_dot(&abc[1], &abc[2]) / b / c) * 180.0 / PI;
+	beta = acos(vec_dot(&abc[0], &abc[2]) / a / c) * 180.0 / PI;
+	gamma = acos(vec_dot(&abc[0], &abc[1]) / a / b) * 180.0 / PI;
+
+	fprintf(fp, CRYSTFMT, a, b, c, alpha, beta, gamma);
+	fprintf(fp, "\n");
+}
+
+/* extended xyz keeps the cell in the comment line */
+static int
+parse_lattice(const char *buf, vec_t *abc)
+{
+	const char *ptr;
+
+	if ((ptr = strstr(buf, "Lattice=\"")) == NULL)
+		return (0);
+	if (sscanf(ptr + 9, "%lf%lf%lf%lf%lf%lf%lf%lf%lf",
+	    &abc[0].x, &abc[0].y, &abc[0].z,
+	    &abc[1].x, &abc[1].y, &abc[1].z,
+	    &abc[2].x, &abc[2].y, &abc[2].z) != 9)
+		return (0);
+	return (1);
+}
 
 static int
 load_from_pdb(struct atoms *atoms, FILE *fp)
 {
-	vec_t xyz;
-	int i, j, k = 0, natoms = 0;
+	vec_t xyz, abc[3];
+	int i, j, k = 0, natoms = 0, newcell = 0;
 	char *buf = NULL, name[8];
 
 	while ((buf = util_next_line(buf, fp)) != NULL) {
+		if (strncasecmp(buf, "CRYST1", 6) == 0 &&
+		    parse_cryst1(buf, abc)) {
+			/* the cell precedes the atoms of its frame */
+			if (natoms == 0)
+				atoms_set_cell(atoms, abc);
+			else
+				newcell = 1;
+		}
 		if (strncasecmp(buf, "ATOM  ", 6) == 0 ||
 		    strncasecmp(buf, "HETATM", 6) == 0) {
 			if (strlen(buf) < 54) {
@@ -70,8 +143,12 @@ load_from_pdb(struct atoms *atoms, FILE *fp)
 					free(buf);
 					return (0);
 				}
-				if (k == 0)
+				if (k == 0) {
 					atoms_add_frame(atoms);
+					if (newcell)
+						atoms_set_cell(atoms, abc);
+					newcell = 0;
+				}
 				atoms_set_xyz(atoms, k++, xyz);
 			}
 		}
@@ -89,7 +166,7 @@ load_from_pdb(struct atoms *atoms, FILE *fp)
 static void
 save_to_pdb(struct atoms *atoms, FILE *fp)
 {
-	vec_t xyz;
+	vec_t xyz, abc[3];
 	int i, j, natoms, nframes;
 	const char *name;
 
@@ -98,6 +175,8 @@ save_to_pdb(struct atoms *atoms, FILE *fp)
 
 	for (i = 0; i < nframes; i++) {
 		atoms_set_frame(atoms, i);
+		if (atoms_get_cell(atoms, abc))
+			write_cryst1(abc, fp);
 		for (j = 0; j < natoms; j++) {
 			name = atoms_get_name(atoms, j);
 			xyz = atoms_get_xyz(atoms, j);
@@ -111,7 +190,7 @@ save_to_pdb(struct atoms *atoms, FILE *fp)
 static int
 load_from_xyz(struct atoms *atoms, FILE *fp)
 {
-	vec_t xyz;
+	vec_t xyz, abc[3];
 	int i, natoms;
 	char *buf = NULL, name[32];
 
@@ -123,6 +202,10 @@ load_from_xyz(struct atoms *atoms, FILE *fp)
 	}
 	if ((buf = util_next_line(buf, fp)) == NULL)
 		return (0);
+	if (parse_lattice(buf, abc))
+		atoms_set_cell(atoms, abc);
+	/* do not trust a damaged count with a huge allocation */
+	atoms_reserve(atoms, natoms < 1000000 ? natoms : 1000000, 1);
 	for (i = 0; i < natoms; i++) {
 		if ((buf = util_next_line(buf, fp)) == NULL)
 			return (0);
@@ -147,6 +230,8 @@ load_from_xyz(struct atoms *atoms, FILE *fp)
 		if ((buf = util_next_line(buf, fp)) == NULL)
 			return (0);
 		atoms_add_frame(atoms);
+		if (parse_lattice(buf, abc))
+			atoms_set_cell(atoms, abc);
 		for (i = 0; i < natoms; i++) {
 			if ((buf = util_next_line(buf, fp)) == NULL)
 				return (0);
@@ -172,7 +257,7 @@ load_from_xyz(struct atoms *atoms, FILE *fp)
 static void
 save_to_xyz(struct atoms *atoms, FILE *fp)
 {
-	vec_t xyz;
+	vec_t xyz, abc[3];
 	int i, j, natoms, nframes;
 	const char *name;
 
@@ -181,7 +266,12 @@ save_to_xyz(struct atoms *atoms, FILE *fp)
 
 	for (i = 0; i < nframes; i++) {
 		atoms_set_frame(atoms, i);
-		fprintf(fp, "%d\n\n", natoms);
+		fprintf(fp, "%d\n", natoms);
+		if (atoms_get_cell(atoms, abc))
+			fprintf(fp, LATTICEFMT, abc[0].x, abc[0].y, abc[0].z,
+			    abc[1].x, abc[1].y, abc[1].z,
+			    abc[2].x, abc[2].y, abc[2].z);
+		fprintf(fp, "\n");
 		for (j = 0; j < natoms; j++) {
 			name = atoms_get_name(atoms, j);
 			xyz = atoms_get_xyz(atoms, j);
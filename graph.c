@@ -25,8 +25,19 @@ struct graphedge {
 struct graph {
 	int nalloc, nelts;
 	struct graphedge **edges;
+	version_t version;
+	void (*hook)(void *, int, int, int, int);
+	void *hookdata;
 };
 
+/* report a change of bond i-j from one type to another, 0 is no bond */
+static void
+notify(struct graph *graph, int i, int j, int from, int to)
+{
+	if (graph->hook)
+		(graph->hook)(graph->hookdata, i, j, from, to);
+}
+
 static void
 remove_edge(struct graph *graph, struct graphedge *edge)
 {
@@ -49,35 +60,18 @@ graph_create(void)
 	graph = xcalloc(1, sizeof *graph);
 	graph->nalloc = 8;
 	graph->edges = xcalloc(graph->nalloc, sizeof *graph->edges);
+	graph->version = util_next_version();
 
 	return (graph);
 }
 
-struct graph *
-graph_copy(struct graph *graph)
-{
-	struct graph *copy;
-	struct graphedge *edge;
-	int i;
-
-	copy = graph_create();
-
-	for (i = 0; i < graph_get_vertex_count(graph); i++)
-		graph_vertex_add(copy);
-
-	for (i = 0; i < graph_get_vertex_count(graph); i++)
-		for (edge = graph->edges[i]; edge; edge = edge->next)
-			graph_edge_create(copy, edge->i, edge->j, edge->type);
-
-	return (copy);
-}
-
 void
 graph_free(struct graph *graph)
 {
 	int i;
 
 	if (graph) {
+		graph->hook = NULL;
 		for (i = 0; i < graph_get_vertex_count(graph); i++)
 			graph_remove_vertex_edges(graph, i);
 		free(graph->edges);
@@ -94,6 +88,7 @@ graph_clear(struct graph *graph)
 		graph_remove_vertex_edges(graph, i);
 
 	graph->nelts = 0;
+	graph->version = util_next_version();
 }
 
 void
@@ -106,6 +101,7 @@ graph_vertex_add(struct graph *graph)
 	}
 	graph->edges[graph->nelts] = NULL;
 	graph->nelts++;
+	graph->version = util_next_version();
 }
 
 void
@@ -127,6 +123,81 @@ graph_vertex_remove(struct graph *graph, int idx)
 			if (edge->j > idx) edge->j--;
 		}
 	}
+	graph->version = util_next_version();
+}
+
+/*
+ * Remove many vertices at once.  The map gives the new index of each
+ * vertex or -1 for vertices to remove, kept vertices must keep their
+ * order.
+ */
+void
+graph_vertex_remove_many(struct graph *graph, const int *map)
+{
+	struct graphedge *edge;
+	int i, n;
+
+	for (i = 0; i < graph_get_vertex_count(graph); i++)
+		if (map[i] == -1)
+			graph_remove_vertex_edges(graph, i);
+
+	for (i = 0, n = 0; i < graph_get_vertex_count(graph); i++) {
+		if (map[i] == -1)
+			continue;
+		for (edge = graph->edges[i]; edge; edge = edge->next) {
+			edge->i = map[edge->i];
+			edge->j = map[edge->j];
+		}
+		graph->edges[n++] = graph->edges[i];
+	}
+	graph->nelts = n;
+	graph->version = util_next_version();
+}
+
+/*
+ * Insert vertices without edges, the opposite of graph_vertex_remove_many.
+ * The map gives the new index of each existing vertex, n is the new
+ * number of vertices.
+ */
+void
+graph_vertex_insert_many(struct graph *graph, int n, const int *map)
+{
+	struct graphedge *edge;
+	int i;
+
+	if (n > graph->nalloc) {
+		while (graph->nalloc < n)
+			graph->nalloc *= 2;
+		graph->edges = xrealloc(graph->edges,
+		    graph->nalloc * sizeof *graph->edges);
+	}
+	for (i = graph_get_vertex_count(graph) - 1; i >= 0; i--) {
+		for (edge = graph->edges[i]; edge; edge = edge->next) {
+			edge->i = map[edge->i];
+			edge->j = map[edge->j];
+		}
+	}
+	for (i = graph_get_vertex_count(graph); i < n; i++)
+		graph->edges[i] = NULL;
+	for (i = graph_get_vertex_count(graph) - 1; i >= 0; i--) {
+		graph->edges[map[i]] = graph->edges[i];
+		if (map[i] != i)
+			graph->edges[i] = NULL;
+	}
+	graph->nelts = n;
+	graph->version = util_next_version();
+}
+
+/*
+ * Call hook with the two atoms and the old and new type whenever a bond
+ * is created, removed or changed.
+ */
+void
+graph_set_hook(struct graph *graph, void (*hook)(void *, int, int, int, int),
+    void *data)
+{
+	graph->hook = hook;
+	graph->hookdata = data;
 }
 
 int
@@ -135,6 +206,12 @@ graph_get_vertex_count(struct graph *graph)
 	return (graph->nelts);
 }
 
+version_t
+graph_get_version(struct graph *graph)
+{
+	return (graph->version);
+}
+
 int
 graph_get_edge_count(struct graph *graph, int idx)
 {
@@ -156,10 +233,16 @@ graph_remove_vertex_edges(struct graph *graph, int idx)
 {
 	assert(idx >= 0 && idx < graph_get_vertex_count(graph));
 
+	if (graph->edges[idx] == NULL)
+		return;
+
 	while (graph->edges[idx]) {
+		notify(graph, idx, graph->edges[idx]->j,
+		    graph->edges[idx]->type, 0);
 		remove_edge(graph, graph->edges[idx]->rev);
 		remove_edge(graph, graph->edges[idx]);
 	}
+	graph->version = util_next_version();
 }
 
 void
@@ -172,7 +255,7 @@ graph_edge_create(struct graph *graph, int i, int j, int type)
 	assert(i != j);
 
 	if ((edge_i = graph_edge_find(graph, i, j))) {
-		graph_edge_set_type(edge_i, type);
+		graph_edge_set_type(graph, edge_i, type);
 		return;
 	}
 
@@ -198,6 +281,8 @@ graph_edge_create(struct graph *graph, int i, int j, int type)
 		graph->edges[j]->prev = edge_j;
 	}
 	graph->edges[j] = edge_j;
+	notify(graph, i, j, 0, type);
+	graph->version = util_next_version();
 }
 
 void
@@ -212,8 +297,10 @@ graph_edge_remove(struct graph *graph, int i, int j)
 	edge = graph_edge_find(graph, i, j);
 
 	if (edge) {
+		notify(graph, i, j, edge->type, 0);
 		remove_edge(graph, edge->rev);
 		remove_edge(graph, edge);
+		graph->version = util_next_version();
 	}
 }
 
@@ -260,10 +347,15 @@ graph_edge_get_type(struct graphedge *edge)
 }
 
 void
-graph_edge_set_type(struct graphedge *edge, int type)
+graph_edge_set_type(struct graph *graph, struct graphedge *edge, int type)
 {
+	if (edge->type == type)
+		return;
+
+	notify(graph, edge->i, edge->j, edge->type, type);
 	edge->type = type;
 	edge->rev->type = type;
+	graph->version = util_next_version();
 }
 
 int
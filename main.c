@@ -24,6 +24,7 @@ main(int argc, char **argv)
 	int idx;
 
 	settings_init();
+	pool_init();
 
 	if (SDL_Init(SDL_INIT_VIDEO))
 		fatal("SDL_Init: %s", SDL_GetError());
@@ -44,6 +45,7 @@ main(int argc, char **argv)
 
 	state_save(state);
 	state_free(state);
+	pool_free();
 	SDL_Quit();
 	settings_free();
 
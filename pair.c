@@ -61,6 +61,20 @@ pairs_add(struct pairs *pairs, int i, int j)
 	pairs->nelts++;
 }
 
+void
+pairs_append(struct pairs *pairs, struct pairs *src)
+{
+	if (pairs->nelts + src->nelts > pairs->nalloc) {
+		while (pairs->nelts + src->nelts > pairs->nalloc)
+			pairs->nalloc *= 2;
+		pairs->data = xrealloc(pairs->data,
+		    pairs->nalloc * sizeof *pairs->data);
+	}
+	memcpy(pairs->data + pairs->nelts, src->data,
+	    src->nelts * sizeof *src->data);
+	pairs->nelts += src->nelts;
+}
+
 int
 pairs_get_count(struct pairs *pairs)
 {
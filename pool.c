@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2013-2017 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "vimol.h"
+
+/*
+ * A pool of worker threads.  pool_run() calls a function for each job index
+ * and returns when all jobs are done.  The calling thread works on the jobs
+ * too.  Threads are started on first use and restarted when the
+ * thread-count setting changes.  Jobs must not call pool_run() themselves.
+ */
+
+struct pool {
+	int nwanted;        /* value of thread-count the pool was started for */
+	int nthreads;       /* worker threads, not counting the caller */
+	SDL_Thread **threads;
+	SDL_mutex *mutex;
+	SDL_cond *start;
+	SDL_cond *done;
+	int generation;
+	int quit;
+	void (*fn)(void *, int);
+	void *data;
+	int njobs, nextjob, ndone;
+};
+
+static struct pool *pool = NULL;
+
+static void
+run_jobs(void)
+{
+	int job;
+
+	while (pool->nextjob < pool->njobs) {
+		job = pool->nextjob++;
+		SDL_UnlockMutex(pool->mutex);
+		(pool->fn)(pool->data, job);
+		SDL_LockMutex(pool->mutex);
+		if (++pool->ndone == pool->njobs)
+			SDL_CondBroadcast(pool->done);
+	}
+}
+
+static int
+worker(void *arg __unused)
+{
+	int generation;
+
+	SDL_LockMutex(pool->mutex);
+	generation = pool->generation;
+
+	for (;;) {
+		while (!pool->quit && generation == pool->generation)
+			SDL_CondWait(pool->start, pool->mutex);
+		if (pool->quit)
+			break;
+		generation = pool->generation;
+		run_jobs();
+	}
+
+	SDL_UnlockMutex(pool->mutex);
+	return (0);
+}
+
+static void
+stop_threads(void)
+{
+	int i;
+
+	SDL_LockMutex(pool->mutex);
+	pool->quit = 1;
+	SDL_CondBroadcast(pool->start);
+	SDL_UnlockMutex(pool->mutex);
+
+	for (i = 0; i < pool->nthreads; i++)
+		SDL_WaitThread(pool->threads[i], NULL);
+
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->nthreads = 0;
+	pool->quit = 0;
+}
+
+static void
+start_threads(int nthreads)
+{
+	SDL_Thread *thread;
+
+	pool->threads = xcalloc(nthreads, sizeof *pool->threads);
+
+	while (pool->nthreads < nthreads) {
+		thread = SDL_CreateThread(worker, "vimol-worker", NULL);
+		if (thread == NULL)
+			break;
+		pool->threads[pool->nthreads++] = thread;
+	}
+}
+
+void
+pool_init(void)
+{
+	pool = xcalloc(1, sizeof *pool);
+
+	if ((pool->mutex = SDL_CreateMutex()) == NULL)
+		fatal("%s", SDL_GetError());
+	if ((pool->start = SDL_CreateCond()) == NULL)
+		fatal("%s", SDL_GetError());
+	if ((pool->done = SDL_CreateCond()) == NULL)
+		fatal("%s", SDL_GetError());
+}
+
+void
+pool_free(void)
+{
+	if (pool) {
+		stop_threads();
+		SDL_DestroyCond(pool->done);
+		SDL_DestroyCond(pool->start);
+		SDL_DestroyMutex(pool->mutex);
+		free(pool);
+		pool = NULL;
+	}
+}
+
+int
+pool_get_thread_count(void)
+{
+	int n;
+
+	if ((n = settings_get_int("thread-count")) < 1)
+		n = SDL_GetCPUCount();
+
+	return (n < 1 ? 1 : n);
+}
+
+void
+pool_run(void (*fn)(void *, int), void *data, int njobs)
+{
+	int i, nthreads;
+
+	nthreads = pool_get_thread_count();
+
+	if (pool == NULL || nthreads == 1 || njobs < 2) {
+		for (i = 0; i < njobs; i++)
+			fn(data, i);
+		return;
+	}
+
+	if (pool->nwanted != nthreads) {
+		stop_threads();
+		start_threads(nthreads - 1);
+		pool->nwanted = nthreads;
+	}
+
+	SDL_LockMutex(pool->mutex);
+	pool->fn = fn;
+	pool->data = data;
+	pool->njobs = njobs;
+	pool->nextjob = 0;
+	pool->ndone = 0;
+	pool->generation++;
+	SDL_CondBroadcast(pool->start);
+
+	run_jobs();
+
+	while (pool->ndone < pool->njobs)
+		SDL_CondWait(pool->done, pool->mutex);
+
+	pool->fn = NULL;
+	pool->data = NULL;
+	SDL_UnlockMutex(pool->mutex);
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2013-2017 Ilya Kaliman
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "vimol.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Discs and lines are recorded first and drawn by raster_draw().  The
+ * target is split into bands of rows which are drawn in parallel, each
+ * with the primitives that touch it, in the order they were recorded.
+ */
+
+#define BAND_ROWS 64
+#define MAX_RADIUS 4096
+
+enum prim_type {
+	PRIM_DISC,
+	PRIM_LINE
+};
+
+struct prim {
+	enum prim_type type;
+	Uint32 value;
+	int x1, y1, x2, y2;     /* center or ends in pixels */
+	int size;               /* disc radius or line width */
+	double radius;
+};
+
+struct raster {
+	unsigned char *data;    /* RGB24 pixels */
+	int width, height, stride;
+	int nprims, nprimsalloc;
+	struct prim *prims;
+	int nbands, nbandsalloc;
+	int *bandstart;         /* first entry of each band in bandprims */
+	int nbandprimsalloc;
+	int *bandprims;         /* primitive indices by band */
+};
+
+/* rows of one band and the half widths of the last disc drawn there */
+struct band {
+	int y0, y1;
+	double radius;
+	int span[MAX_RADIUS + 1];
+};
+
+static Uint32
+get_pixel(color_t color)
+{
+	return ((Uint32)(color.r * 255.0 + 0.5) << 16 |
+	    (Uint32)(color.g * 255.0 + 0.5) << 8 |
+	    (Uint32)(color.b * 255.0 + 0.5));
+}
+
+static Uint32 *
+get_row(struct raster *raster, int y)
+{
+	return ((Uint32 *)(raster->data + (size_t)y * raster->stride));
+}
+
+static void
+fill_span(Uint32 *p, int n, Uint32 value)
+{
+#if defined(__SSE2__)
+	__m128i v;
+
+	v = _mm_set1_epi32((int)value);
+
+	for (; n >= 4; n -= 4, p += 4)
+		_mm_storeu_si128((__m128i *)p, v);
+#endif
+	while (n-- > 0)
+		*p++ = value;
+}
+
+/* fill pixels x0 to x1 of row y, clipped to the band */
+static void
+fill_row(struct raster *raster, struct band *band, int y, int x0, int x1,
+    Uint32 value)
+{
+	if (y < band->y0 || y >= band->y1)
+		return;
+	if (x0 < 0)
+		x0 = 0;
+	if (x1 >= raster->width)
+		x1 = raster->width - 1;
+	if (x0 <= x1)
+		fill_span(get_row(raster, y) + x0, x1 - x0 + 1, value);
+}
+
+/*
+ * Clip a line to the target grown by a margin, Liang-Barsky style.
+ * Returns zero if nothing of the line is left.
+ */
+static int
+clip_line(struct raster *raster, double margin, double *x1, double *y1,
+    double *x2, double *y2)
+{
+	double p[4], q[4], t0, t1, r, dx, dy;
+	int i;
+
+	dx = *x2 - *x1;
+	dy = *y2 - *y1;
+	p[0] = -dx, q[0] = *x1 + margin;
+	p[1] = dx, q[1] = raster->width - 1 + margin - *x1;
+	p[2] = -dy, q[2] = *y1 + margin;
+	p[3] = dy, q[3] = raster->height - 1 + margin - *y1;
+	t0 = 0.0;
+	t1 = 1.0;
+
+	for (i = 0; i < 4; i++) {
+		if (p[i] == 0.0) {
+			if (q[i] < 0.0)
+				return (0);
+			continue;
+		}
+		r = q[i] / p[i];
+		if (p[i] < 0.0) {
+			if (r > t1)
+				return (0);
+			if (r > t0)
+				t0 = r;
+		} else {
+			if (r < t0)
+				return (0);
+			if (r < t1)
+				t1 = r;
+		}
+	}
+	*x2 = *x1 + t1 * dx;
+	*y2 = *y1 + t1 * dy;
+	*x1 = *x1 + t0 * dx;
+	*y1 = *y1 + t0 * dy;
+	return (1);
+}
+
+static struct prim *
+add_prim(struct raster *raster, enum prim_type type, color_t color)
+{
+	struct prim *prim;
+
+	if (raster->nprims == raster->nprimsalloc) {
+		raster->nprimsalloc = raster->nprimsalloc ?
+		    2 * raster->nprimsalloc : 1024;
+		raster->prims = xrealloc(raster->prims,
+		    raster->nprimsalloc * sizeof *raster->prims);
+	}
+	prim = raster->prims + raster->nprims++;
+	prim->type = type;
+	prim->value = get_pixel(color);
+
+	return (prim);
+}
+
+static void
+get_prim_rows(struct prim *prim, int *y0, int *y1)
+{
+	if (prim->type == PRIM_DISC) {
+		*y0 = prim->y1 - prim->size;
+		*y1 = prim->y1 + prim->size;
+	} else {
+		*y0 = (prim->y1 < prim->y2 ? prim->y1 : prim->y2) - prim->size;
+		*y1 = (prim->y1 > prim->y2 ? prim->y1 : prim->y2) + prim->size;
+	}
+}
+
+static void
+draw_disc(struct raster *raster, struct band *band, struct prim *prim)
+{
+	int i, n, x, y;
+
+	x = prim->x1;
+	y = prim->y1;
+
+	if (prim->size == 0) {
+		fill_row(raster, band, y, x, x, prim->value);
+		return;
+	}
+	if (prim->radius != band->radius) {
+		n = prim->size;
+		for (i = 0; i <= n; i++)
+			band->span[i] = (int)sqrt(prim->radius * prim->radius -
+			    (double)i * i);
+		band->radius = prim->radius;
+	}
+	for (i = -prim->size; i <= prim->size; i++)
+		fill_row(raster, band, y + i, x - band->span[abs(i)],
+		    x + band->span[abs(i)], prim->value);
+}
+
+/* Bresenham line, each step fills a run across the major axis */
+static void
+draw_line(struct raster *raster, struct band *band, struct prim *prim)
+{
+	int ix, iy, ex, ey, dx, dy, sx, sy, err, e2, w, h, k;
+
+	ix = prim->x1;
+	iy = prim->y1;
+	ex = prim->x2;
+	ey = prim->y2;
+	dx = abs(ex - ix);
+	dy = -abs(ey - iy);
+	sx = ix < ex ? 1 : -1;
+	sy = iy < ey ? 1 : -1;
+	err = dx + dy;
+	w = prim->size;
+	h = (w - 1) / 2;
+
+	for (;;) {
+		if (dx >= -dy) {
+			if (ix >= 0 && ix < raster->width)
+				for (k = iy - h; k < iy - h + w; k++)
+					if (k >= band->y0 && k < band->y1)
+						get_row(raster, k)[ix] =
+						    prim->value;
+		} else
+			fill_row(raster, band, iy, ix - h, ix - h + w - 1,
+			    prim->value);
+
+		if (ix == ex && iy == ey)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			ix += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			iy += sy;
+		}
+	}
+}
+
+static void
+draw_band(void *data, int idx)
+{
+	struct raster *raster = data;
+	struct prim *prim;
+	struct band band;
+	int i;
+
+	band.y0 = idx * BAND_ROWS;
+	band.y1 = band.y0 + BAND_ROWS;
+	if (band.y1 > raster->height)
+		band.y1 = raster->height;
+	band.radius = -1.0;
+
+	for (i = raster->bandstart[idx]; i < raster->bandstart[idx + 1]; i++) {
+		prim = raster->prims + raster->bandprims[i];
+		if (prim->type == PRIM_DISC)
+			draw_disc(raster, &band, prim);
+		else
+			draw_line(raster, &band, prim);
+	}
+}
+
+/* sort primitives into the bands they touch, keeping their order */
+static void
+bin_prims(struct raster *raster)
+{
+	int i, b, b0, b1, y0, y1, n, *start;
+
+	raster->nbands = (raster->height + BAND_ROWS - 1) / BAND_ROWS;
+	if (raster->nbands + 1 > raster->nbandsalloc) {
+		raster->nbandsalloc = raster->nbands + 1;
+		raster->bandstart = xrealloc(raster->bandstart,
+		    raster->nbandsalloc * sizeof *raster->bandstart);
+	}
+	start = raster->bandstart;
+	memset(start, 0, (raster->nbands + 1) * sizeof *start);
+
+	for (n = 0, i = 0; i < raster->nprims; i++) {
+		get_prim_rows(raster->prims + i, &y0, &y1);
+		b0 = y0 < 0 ? 0 : y0 / BAND_ROWS;
+		b1 = y1 / BAND_ROWS;
+		if (b1 >= raster->nbands)
+			b1 = raster->nbands - 1;
+		for (b = b0; b <= b1; b++, n++)
+			start[b + 1]++;
+	}
+	for (b = 0; b < raster->nbands; b++)
+		start[b + 1] += start[b];
+
+	if (n > raster->nbandprimsalloc) {
+		raster->nbandprimsalloc = n;
+		raster->bandprims = xrealloc(raster->bandprims,
+		    n * sizeof *raster->bandprims);
+	}
+	for (i = 0; i < raster->nprims; i++) {
+		get_prim_rows(raster->prims + i, &y0, &y1);
+		b0 = y0 < 0 ? 0 : y0 / BAND_ROWS;
+		b1 = y1 / BAND_ROWS;
+		if (b1 >= raster->nbands)
+			b1 = raster->nbands - 1;
+		for (b = b0; b <= b1; b++)
+			raster->bandprims[start[b]++] = i;
+	}
+	/* filling moved each start to the start of the next band */
+	for (b = raster->nbands; b > 0; b--)
+		start[b] = start[b - 1];
+	start[0] = 0;
+}
+
+struct raster *
+raster_create(void)
+{
+	struct raster *raster;
+
+	raster = xcalloc(1, sizeof *raster);
+
+	return (raster);
+}
+
+void
+raster_free(struct raster *raster)
+{
+	if (raster) {
+		free(raster->prims);
+		free(raster->bandstart);
+		free(raster->bandprims);
+		free(raster);
+	}
+}
+
+void
+raster_set_target(struct raster *raster, unsigned char *data, int width,
+    int height, int stride)
+{
+	raster->data = data;
+	raster->width = width;
+	raster->height = height;
+	raster->stride = stride;
+	raster->nprims = 0;
+}
+
+void
+raster_disc(struct raster *raster, double x, double y, double radius,
+    color_t color)
+{
+	struct prim *prim;
+
+	if (radius > MAX_RADIUS)
+		radius = MAX_RADIUS;
+	if (x + radius < 0.0 || x - radius >= raster->width ||
+	    y + radius < 0.0 || y - radius >= raster->height)
+		return;
+
+	prim = add_prim(raster, PRIM_DISC, color);
+	prim->x1 = (int)floor(x);
+	prim->y1 = (int)floor(y);
+	prim->radius = radius < 1.0 ? 0.0 : radius;
+	prim->size = (int)prim->radius;
+}
+
+void
+raster_line(struct raster *raster, double x1, double y1, double x2,
+    double y2, double width, color_t color)
+{
+	struct prim *prim;
+	int w;
+
+	w = width < 1.0 ? 1 : (int)(width + 0.5);
+	if (w > MAX_RADIUS)
+		w = MAX_RADIUS;
+	if (!clip_line(raster, w, &x1, &y1, &x2, &y2))
+		return;
+
+	prim = add_prim(raster, PRIM_LINE, color);
+	prim->x1 = (int)floor(x1);
+	prim->y1 = (int)floor(y1);
+	prim->x2 = (int)floor(x2);
+	prim->y2 = (int)floor(y2);
+	prim->size = w;
+}
+
+/* draw and forget everything recorded since raster_set_target() */
+void
+raster_draw(struct raster *raster)
+{
+	if (raster->nprims > 0 && raster->height > 0) {
+		bin_prims(raster);
+		pool_run(draw_band, raster, raster->nbands);
+	}
+	raster->nprims = 0;
+}
@@ -25,8 +25,55 @@ struct sel {
 	int nelts, nalloc, count;
 	struct node *data;
 	int head, tail, iter;
+	version_t version;
+	void (*hook)(void *, struct sel *, int, int);
+	void *hookdata;
 };
 
+static void
+notify(struct sel *sel, int idx, int prev)
+{
+	if (sel->hook)
+		(sel->hook)(sel->hookdata, sel, idx, prev);
+}
+
+static void
+add_elt(struct sel *sel, int idx)
+{
+	if (sel->tail == -1)
+		sel->head = sel->tail = idx;
+	else {
+		sel->data[sel->tail].next = idx;
+		sel->data[idx].prev = sel->tail;
+		sel->tail = idx;
+	}
+
+	sel->count++;
+	sel->version = util_next_version();
+}
+
+static void
+remove_elt(struct sel *sel, int idx)
+{
+	struct node *node;
+
+	node = sel->data + idx;
+
+	if (node->prev != -1)
+		sel->data[node->prev].next = node->next;
+	else
+		sel->head = node->next;
+
+	if (node->next != -1)
+		sel->data[node->next].prev = node->prev;
+	else
+		sel->tail = node->prev;
+
+	sel->data[idx].prev = sel->data[idx].next = -1;
+	sel->count--;
+	sel->version = util_next_version();
+}
+
 struct sel *
 sel_create(int size)
 {
@@ -36,6 +83,7 @@ sel_create(int size)
 	sel->nalloc = 8;
 	sel->data = xcalloc(sel->nalloc, sizeof *sel->data);
 	sel->head = sel->tail = sel->iter = -1;
+	sel->version = util_next_version();
 
 	while (size > 0) {
 		sel_expand(sel);
@@ -57,9 +105,25 @@ sel_copy(struct sel *sel)
 	while (sel_iter_next(sel, &idx))
 		sel_add(copy, idx);
 
+	copy->version = sel->version;
+
 	return (copy);
 }
 
+/*
+ * Call hook before an element is added to or removed from the selection,
+ * with the element and the one it follows in the order of selection, -1
+ * if it is or becomes the first.  Changes to the size of the selection
+ * do not call it.
+ */
+void
+sel_set_hook(struct sel *sel, void (*hook)(void *, struct sel *, int, int),
+    void *data)
+{
+	sel->hook = hook;
+	sel->hookdata = data;
+}
+
 void
 sel_free(struct sel *sel)
 {
@@ -81,6 +145,12 @@ sel_get_count(struct sel *sel)
 	return (sel->count);
 }
 
+version_t
+sel_get_version(struct sel *sel)
+{
+	return (sel->version);
+}
+
 void
 sel_expand(struct sel *sel)
 {
@@ -92,6 +162,7 @@ sel_expand(struct sel *sel)
 	sel->data[sel->nelts].prev = -1;
 	sel->data[sel->nelts].next = -1;
 	sel->nelts++;
+	sel->version = util_next_version();
 }
 
 void
@@ -102,7 +173,8 @@ sel_contract(struct sel *sel, int idx)
 	assert(idx >= 0 && idx < sel_get_size(sel));
 	assert(sel->iter == -1);
 
-	sel_remove(sel, idx);
+	if (sel_selected(sel, idx))
+		remove_elt(sel, idx);
 
 	sel->nelts--;
 
@@ -116,6 +188,79 @@ sel_contract(struct sel *sel, int idx)
 		if (sel->data[i].prev > idx) sel->data[i].prev--;
 		if (sel->data[i].next > idx) sel->data[i].next--;
 	}
+	sel->version = util_next_version();
+}
+
+/*
+ * Remove many elements at once.  The map gives the new index of each
+ * element or -1 for elements to remove, kept elements must keep their
+ * order.  The selection order of kept elements is preserved.
+ */
+void
+sel_contract_many(struct sel *sel, const int *map)
+{
+	int i, n, idx, *order;
+
+	assert(sel->iter == -1);
+
+	order = xcalloc(sel->count + 1, sizeof *order);
+	n = 0;
+
+	for (idx = sel->head; idx != -1; idx = sel->data[idx].next)
+		if (map[idx] != -1)
+			order[n++] = map[idx];
+
+	for (i = 0, idx = 0; i < sel_get_size(sel); i++)
+		if (map[i] != -1)
+			idx++;
+	sel->nelts = idx;
+
+	for (i = 0; i < sel_get_size(sel); i++)
+		sel->data[i].prev = sel->data[i].next = -1;
+	sel->head = sel->tail = -1;
+	sel->count = 0;
+
+	for (i = 0; i < n; i++)
+		add_elt(sel, order[i]);
+	free(order);
+	sel->version = util_next_version();
+}
+
+/*
+ * Insert unselected elements, the opposite of sel_contract_many.  The map
+ * gives the new index of each existing element, n is the new size.
+ */
+void
+sel_expand_many(struct sel *sel, int n, const int *map)
+{
+	struct node node;
+	int i, k;
+
+	assert(sel->iter == -1);
+
+	if (n > sel->nalloc) {
+		while (sel->nalloc < n)
+			sel->nalloc *= 2;
+		sel->data = xrealloc(sel->data,
+		    sel->nalloc * sizeof *sel->data);
+	}
+	for (i = n - 1, k = sel_get_size(sel) - 1; i >= 0; i--) {
+		node.prev = node.next = -1;
+		if (k >= 0 && map[k] == i) {
+			node = sel->data[k--];
+			if (node.prev != -1)
+				node.prev = map[node.prev];
+			if (node.next != -1)
+				node.next = map[node.next];
+		}
+		sel->data[i] = node;
+	}
+	if (sel->head != -1)
+		sel->head = map[sel->head];
+	if (sel->tail != -1)
+		sel->tail = map[sel->tail];
+	sel->nelts = n;
+	sel->version = util_next_version();
 }
 
 void
@@ -126,41 +271,53 @@ sel_add(struct sel *sel, int idx)
 	if (sel_selected(sel, idx))
 		return;
 
-	if (sel->tail == -1)
-		sel->head = sel->tail = idx;
-	else {
-		sel->data[sel->tail].next = idx;
-		sel->data[idx].prev = sel->tail;
-		sel->tail = idx;
+	notify(sel, idx, sel->tail);
+	add_elt(sel, idx);
+}
+
+/*
+ * Add an element right after prev in the order of selection, or first if
+ * prev is -1.  It goes last if prev is not selected.
+ */
+void
+sel_insert(struct sel *sel, int idx, int prev)
+{
+	int next;
+
+	assert(idx >= 0 && idx < sel_get_size(sel));
+
+	if (sel_selected(sel, idx))
+		return;
+
+	if (prev == sel->tail || (prev != -1 &&
+	    (prev >= sel_get_size(sel) || !sel_selected(sel, prev)))) {
+		sel_add(sel, idx);
+		return;
 	}
+	notify(sel, idx, prev);
+	next = prev == -1 ? sel->head : sel->data[prev].next;
+	sel->data[idx].prev = prev;
+	sel->data[idx].next = next;
+	sel->data[next].prev = idx;
+	if (prev == -1)
+		sel->head = idx;
+	else
+		sel->data[prev].next = idx;
 
 	sel->count++;
+	sel->version = util_next_version();
 }
 
 void
 sel_remove(struct sel *sel, int idx)
 {
-	struct node *node;
-
 	assert(idx >= 0 && idx < sel_get_size(sel));
 
 	if (!sel_selected(sel, idx))
 		return;
 
-	node = sel->data + idx;
-
-	if (node->prev != -1)
-		sel->data[node->prev].next = node->next;
-	else
-		sel->head = node->next;
-
-	if (node->next != -1)
-		sel->data[node->next].prev = node->prev;
-	else
-		sel->tail = node->prev;
-
-	sel->data[idx].prev = sel->data[idx].next = -1;
-	sel->count--;
+	notify(sel, idx, sel->data[idx].prev);
+	remove_elt(sel, idx);
 }
 
 void
@@ -181,6 +338,18 @@ sel_clear(struct sel *sel)
 		sel_remove(sel, i);
 }
 
+/* store selected elements in the order of selection, return their count */
+int
+sel_get_list(struct sel *sel, int *list)
+{
+	int idx, n;
+
+	for (idx = sel->head, n = 0; idx != -1; idx = sel->data[idx].next)
+		list[n++] = idx;
+
+	return (n);
+}
+
 int
 sel_selected(struct sel *sel, int idx)
 {
@@ -36,11 +36,13 @@ struct node {
 	const char *name;
 	enum node_type type;
 	union data data;
+	version_t version;
 };
 
 struct settings {
 	int nelts, nalloc;
 	struct node *data;
+	version_t version;
 };
 
 static struct settings *settings = NULL;
@@ -72,6 +74,7 @@ set_data(struct node *node, union data data)
 		free(node->data.xstring);
 
 	node->data = data;
+	node->version = settings->version = util_next_version();
 
 	return (1);
 }
@@ -147,12 +150,20 @@ static const struct {
 	{ "atom-size", NODE_TYPE_DOUBLE, "8.0" },
 	{ "atom-visible", NODE_TYPE_BOOL, "true" },
 	{ "bg-color", NODE_TYPE_COLOR, "0 0 0" },
+	{ "bond-per-frame", NODE_TYPE_BOOL, "false" },
 	{ "bond-size", NODE_TYPE_DOUBLE, "3.0" },
+	{ "bond-skin", NODE_TYPE_DOUBLE, "1.0" },
+	{ "bond-tolerance", NODE_TYPE_DOUBLE, "0.4" },
 	{ "bond-visible", NODE_TYPE_BOOL, "true" },
+	{ "depth-sort", NODE_TYPE_BOOL, "false" },
+	{ "group-colors", NODE_TYPE_BOOL, "false" },
 	{ "id-color", NODE_TYPE_COLOR, "255 255 255" },
 	{ "id-font", NODE_TYPE_STRING, VIMOL_DEFAULT_FONT },
 	{ "id-font-size", NODE_TYPE_DOUBLE, "12.0" },
 	{ "id-visible", NODE_TYPE_BOOL, "false" },
+	{ "lod-atom-count", NODE_TYPE_INT, "20000" },
+	{ "lod-frame-time", NODE_TYPE_INT, "40" },
+	{ "lod-idle-time", NODE_TYPE_INT, "300" },
 	{ "name-color", NODE_TYPE_COLOR, "0 255 0" },
 	{ "name-font", NODE_TYPE_STRING, VIMOL_DEFAULT_FONT },
 	{ "name-font-size", NODE_TYPE_DOUBLE, "12.0" },
@@ -162,6 +173,8 @@ static const struct {
 	{ "origin-font-size", NODE_TYPE_DOUBLE, "16.0" },
 	{ "origin-line-width", NODE_TYPE_DOUBLE, "2.0" },
 	{ "origin-visible", NODE_TYPE_BOOL, "false" },
+	{ "raster-atom-count", NODE_TYPE_INT, "100000" },
+	{ "render-backend", NODE_TYPE_STRING, "auto" },
 	{ "selection-color", NODE_TYPE_COLOR, "255 255 0" },
 	{ "selection-size", NODE_TYPE_DOUBLE, "12.0" },
 	{ "statusbar-color", NODE_TYPE_COLOR, "220 220 220" },
@@ -170,6 +183,9 @@ static const struct {
 	{ "statusbar-font-size", NODE_TYPE_DOUBLE, "16.0" },
 	{ "statusbar-text-color", NODE_TYPE_COLOR, "0 0 0" },
 	{ "statusbar-visible", NODE_TYPE_BOOL, "true" },
+	{ "thread-count", NODE_TYPE_INT, "0" },
+	{ "undo-memory", NODE_TYPE_INT, "256" },
+	{ "undo-truncate", NODE_TYPE_BOOL, "false" },
 	{ "color-x", NODE_TYPE_COLOR, "255 0 255" },
 	{ "color-h", NODE_TYPE_COLOR, "255 255 255" },
 	{ "color-he", NODE_TYPE_COLOR, "217 255 255" },
@@ -460,6 +476,42 @@ settings_get_color(const char *name)
 	return (node->data.xcolor);
 }
 
+version_t
+settings_get_version(void)
+{
+	return (settings->version);
+}
+
+/* latest change to settings whose names do or do not start with prefix */
+static version_t
+get_prefix_version(const char *prefix, int match)
+{
+	version_t version = 0;
+	size_t len;
+	int i;
+
+	len = strlen(prefix);
+
+	for (i = 0; i < settings->nelts; i++)
+		if ((strncasecmp(settings->data[i].name, prefix, len) == 0) ==
+		    match && settings->data[i].version > version)
+			version = settings->data[i].version;
+
+	return (version);
+}
+
+version_t
+settings_get_prefix_version(const char *prefix)
+{
+	return (get_prefix_version(prefix, 1));
+}
+
+version_t
+settings_get_other_version(const char *prefix)
+{
+	return (get_prefix_version(prefix, 0));
+}
+
 int
 settings_set(const char *name, const char *value)
 {
@@ -16,29 +16,256 @@
 
 #include "vimol.h"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Cell-list spatial index.  Points are binned into cubic cells whose edge is
+ * the search distance, so all neighbours of a point lie in the 27 cells
+ * around it.  Only occupied cells are stored; they are found through an open
+ * addressing hash on the integer cell coordinates.  Point indices are sorted
+ * by cell with a counting sort into a single flat array.
+ *
+ * Points can be added, moved and removed without a rebuild.  Each cell owns
+ * a slot range of the flat array; a cell that outgrows its range is moved to
+ * a larger one at the end of the array.  The index is rebuilt from scratch
+ * once the array has grown too sparse.
+ *
+ * With a periodic lattice the cells split the unit cell in fractional
+ * coordinates instead, each at least the search distance wide, and points
+ * are wrapped into the unit cell.  Neighbour cells across a face of the unit
+ * cell are found by wrapping the cell coordinates, which also gives the
+ * lattice shift of the neighbour's image.
+ *
+ * Coordinates are also kept as separate x, y and z arrays laid out like the
+ * flat array, so that a point can be tested against a whole cell at once.
+ */
+
 struct cell {
-	int nelts, nalloc;
-	int *data;
+	int x, y, z;        /* integer cell coordinates */
+	int start, count;   /* range in spi->order */
+	int cap;            /* slots reserved at start */
 };
 
 struct spi {
 	struct pairs *pairs;
+	int nchunks, nchunksalloc;
+	struct pairs **chunks;  /* per-job pair buffers */
+	double r2;
+	int (*filter)(void *, int, int, double);
+	void *filterdata;
 	int npoints, npointsalloc;
 	vec_t *points;
+	vec_t *wrapped;     /* points moved into the unit cell */
+	int is_periodic;
+	vec_t lattice[3];   /* unit cell vectors */
+	vec_t recip[3];     /* fractional coordinate is recip[i] . xyz */
+	double width[3];    /* distances between opposite faces */
+	double halfwidth2;  /* squared half of the smallest width */
+	int ngrid[3];       /* cells along each lattice vector */
+	int is_valid;       /* cells match points */
+	double cellsize;
+	vec_t origin;
+	int cmin[3], cmax[3];   /* range of cell coordinates */
+	int ncells, ncellsalloc;
+	struct cell *cells;
+	int nbuckets;
+	int *buckets;       /* cell index or -1 */
+	int *pointcell;     /* cell index of each point */
+	int *pointpos;      /* position of each point in spi->order */
+	int norder, norderalloc;
+	int *order;         /* point indices sorted by cell */
+	double *sx, *sy, *sz;   /* coordinates of the points in spi->order */
+};
+
+#define SPI_DEFAULT_CELL_SIZE 2.0
+#define SPI_CHUNK_CELLS 64
+#define SPI_MAX_CHUNKS 256
+#define SPI_MIN_CELL_CAP 4
+#define SPI_MAX_SLACK 1024
+#define SPI_MAX_GRID 1000000
+#define SPI_BLOCK 64
+
+/* half of the 26 neighbours, the other half is visited from the other side */
+static const int shell[13][3] = {
+	{ 0, 0, 1 }, { 0, 1, -1 }, { 0, 1, 0 }, { 0, 1, 1 },
+	{ 1, -1, -1 }, { 1, -1, 0 }, { 1, -1, 1 }, { 1, 0, -1 },
+	{ 1, 0, 0 }, { 1, 0, 1 }, { 1, 1, -1 }, { 1, 1, 0 }, { 1, 1, 1 }
 };
 
-#define CIDX(x, y, z) ((x) * ny * nz + (y) * nz + (z))
+static unsigned
+hash_cell(int x, int y, int z)
+{
+	return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^
+	    (unsigned)z * 83492791u);
+}
+
+static int
+find_cell(struct spi *spi, int x, int y, int z)
+{
+	struct cell *cell;
+	unsigned mask;
+	int b, c;
+
+	mask = (unsigned)spi->nbuckets - 1;
+	b = (int)(hash_cell(x, y, z) & mask);
+
+	while ((c = spi->buckets[b]) != -1) {
+		cell = spi->cells + c;
+		if (cell->x == x && cell->y == y && cell->z == z)
+			return (c);
+		b = (int)((unsigned)(b + 1) & mask);
+	}
+	return (-1);
+}
 
 static void
-cell_add_idx(struct cell *cell, int idx)
+fill_buckets(struct spi *spi)
 {
-	if (cell->nelts == cell->nalloc) {
-		cell->nalloc *= 2;
-		cell->data = xrealloc(cell->data,
-		    cell->nalloc * sizeof *cell->data);
+	struct cell *cell;
+	unsigned mask;
+	int b, c;
+
+	for (b = 0; b < spi->nbuckets; b++)
+		spi->buckets[b] = -1;
+
+	mask = (unsigned)spi->nbuckets - 1;
+
+	for (c = 0; c < spi->ncells; c++) {
+		cell = spi->cells + c;
+		b = (int)(hash_cell(cell->x, cell->y, cell->z) & mask);
+		while (spi->buckets[b] != -1)
+			b = (int)((unsigned)(b + 1) & mask);
+		spi->buckets[b] = c;
 	}
-	cell->data[cell->nelts] = idx;
-	cell->nelts++;
+}
+
+static void
+rehash_cells(struct spi *spi)
+{
+	spi->nbuckets *= 2;
+	spi->buckets = xrealloc(spi->buckets,
+	    spi->nbuckets * sizeof *spi->buckets);
+	fill_buckets(spi);
+}
+
+static int
+add_cell(struct spi *spi, int x, int y, int z)
+{
+	struct cell *cell;
+	unsigned mask;
+	int b, c;
+
+	if (2 * (spi->ncells + 1) > spi->nbuckets)
+		rehash_cells(spi);
+
+	mask = (unsigned)spi->nbuckets - 1;
+	b = (int)(hash_cell(x, y, z) & mask);
+
+	while ((c = spi->buckets[b]) != -1) {
+		cell = spi->cells + c;
+		if (cell->x == x && cell->y == y && cell->z == z)
+			return (c);
+		b = (int)((unsigned)(b + 1) & mask);
+	}
+	if (spi->ncells == spi->ncellsalloc) {
+		spi->ncellsalloc *= 2;
+		spi->cells = xrealloc(spi->cells,
+		    spi->ncellsalloc * sizeof *spi->cells);
+	}
+	c = spi->ncells++;
+	cell = spi->cells + c;
+	cell->x = x;
+	cell->y = y;
+	cell->z = z;
+	cell->start = 0;
+	cell->count = 0;
+	cell->cap = 0;
+	spi->buckets[b] = c;
+
+	return (c);
+}
+
+/*
+ * Find the cell at possibly out of range coordinates c.  In a periodic
+ * index the coordinates are wrapped and the lattice shift that takes points
+ * of the found cell to the requested image is stored in shift.
+ */
+static int
+find_image_cell(struct spi *spi, const int *c, vec_t *shift)
+{
+	vec_t t;
+	int i, n, w[3];
+
+	*shift = vec_zero();
+
+	if (!spi->is_periodic)
+		return (find_cell(spi, c[0], c[1], c[2]));
+
+	for (i = 0; i < 3; i++) {
+		n = c[i] >= 0 ? c[i] / spi->ngrid[i] :
+		    -((spi->ngrid[i] - 1 - c[i]) / spi->ngrid[i]);
+		w[i] = c[i] - n * spi->ngrid[i];
+
+		if (n != 0) {
+			t = spi->lattice[i];
+			vec_scale(&t, n);
+			*shift = vec_add(shift, &t);
+		}
+	}
+	return (find_cell(spi, w[0], w[1], w[2]));
+}
+
+static vec_t *
+get_coords(struct spi *spi)
+{
+	return (spi->is_periodic ? spi->wrapped : spi->points);
+}
+
+/* squared distance between the closest images of a and b */
+static double
+image_distsq(struct spi *spi, const vec_t *a, const vec_t *b)
+{
+	vec_t d, e, t;
+	double f, r2, best;
+	int i, j, k;
+
+	if (!spi->is_periodic)
+		return (vec_distsq(a, b));
+
+	d = vec_sub(a, b);
+	for (i = 0; i < 3; i++) {
+		f = vec_dot(&spi->recip[i], &d);
+		t = spi->lattice[i];
+		vec_scale(&t, -floor(f + 0.5));
+		d = vec_add(&d, &t);
+	}
+	best = vec_lensq(&d);
+
+	/* only a very oblique cell can have a closer image */
+	if (best <= spi->halfwidth2)
+		return (best);
+
+	for (i = -1; i <= 1; i++)
+		for (j = -1; j <= 1; j++)
+			for (k = -1; k <= 1; k++) {
+				e = d;
+				t = spi->lattice[0];
+				vec_scale(&t, i);
+				e = vec_add(&e, &t);
+				t = spi->lattice[1];
+				vec_scale(&t, j);
+				e = vec_add(&e, &t);
+				t = spi->lattice[2];
+				vec_scale(&t, k);
+				e = vec_add(&e, &t);
+				if ((r2 = vec_lensq(&e)) < best)
+					best = r2;
+			}
+	return (best);
 }
 
 static void
@@ -51,7 +278,7 @@ calc_box(struct spi *spi, vec_t *pmin, vec_t *pmax)
 	pmax->x = pmax->y = pmax->z = -VIMOL_MAX_XYZ;
 
 	for (i = 0; i < spi_get_point_count(spi); i++) {
-		xyz = spi_get_point(spi, i);
+		xyz = spi->points[i];
 
 		if (xyz.x < pmin->x) pmin->x = xyz.x;
 		if (xyz.y < pmin->y) pmin->y = xyz.y;
@@ -63,66 +290,710 @@ calc_box(struct spi *spi, vec_t *pmin, vec_t *pmax)
 }
 
 static int
-get_cell_count(double x, double dist)
+get_cell_coord(double x, double origin, double cellsize)
+{
+	double c;
+
+	c = floor((x - origin) / cellsize);
+
+	return (c < -1.0e9 ? -1000000000 : c > 1.0e9 ? 1000000000 : (int)c);
+}
+
+static int
+get_grid_size(struct spi *spi, int i, double dist)
+{
+	double n;
+
+	n = floor(spi->width[i] / dist);
+
+	return (n < 1.0 ? 1 : n > SPI_MAX_GRID ? SPI_MAX_GRID : (int)n);
+}
+
+/* cell coordinates of a point, returns the point wrapped into the unit cell */
+static vec_t
+locate_point(struct spi *spi, vec_t xyz, int *c)
 {
-	int n = (int)(x / dist);
+	vec_t wrapped, t;
+	double f;
+	int i;
+
+	if (!spi->is_periodic) {
+		c[0] = get_cell_coord(xyz.x, spi->origin.x, spi->cellsize);
+		c[1] = get_cell_coord(xyz.y, spi->origin.y, spi->cellsize);
+		c[2] = get_cell_coord(xyz.z, spi->origin.z, spi->cellsize);
+		return (xyz);
+	}
 
-	return (n > 16 ? 16 : n < 3 ? 3 : n);
+	wrapped = vec_zero();
+
+	for (i = 0; i < 3; i++) {
+		f = vec_dot(&spi->recip[i], &xyz);
+		f -= floor(f);
+		c[i] = (int)(f * spi->ngrid[i]);
+		if (c[i] >= spi->ngrid[i])
+			c[i] = spi->ngrid[i] - 1;
+		t = spi->lattice[i];
+		vec_scale(&t, f);
+		wrapped = vec_add(&wrapped, &t);
+	}
+	return (wrapped);
 }
 
+/* spread the low 21 bits of v out to every third bit */
+static unsigned long long
+spread_bits(unsigned v)
+{
+	unsigned long long x;
+
+	x = v & 0x1fffffULL;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8) & 0x100f00f00f00f00fULL;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2) & 0x1249249249249249ULL;
+
+	return (x);
+}
+
+struct cellkey {
+	unsigned long long key;
+	int cell;
+};
+
 static int
-get_cell_idx(double x, double xmin, double xmax, int nx)
+compare_cellkey(const void *a, const void *b)
 {
+	const struct cellkey *aa = (const struct cellkey *)a;
+	const struct cellkey *bb = (const struct cellkey *)b;
+
+	return (aa->key < bb->key ? -1 : aa->key > bb->key ? 1 :
+	    aa->cell - bb->cell);
+}
+
+/*
+ * Order cells along a Morton curve, so that cells close in space are also
+ * close in the flat array and in the ranges swept by each job.
+ */
+static void
+sort_cells(struct spi *spi)
+{
+	struct cellkey *keys;
+	struct cell *cells;
+	int c, i, *map;
+
+	keys = xcalloc(spi->ncells, sizeof *keys);
+	for (c = 0; c < spi->ncells; c++) {
+		keys[c].key = spread_bits((unsigned)spi->cells[c].x) |
+		    spread_bits((unsigned)spi->cells[c].y) << 1 |
+		    spread_bits((unsigned)spi->cells[c].z) << 2;
+		keys[c].cell = c;
+	}
+	qsort(keys, spi->ncells, sizeof *keys, compare_cellkey);
+
+	cells = xcalloc(spi->ncellsalloc, sizeof *cells);
+	map = xcalloc(spi->ncells, sizeof *map);
+	for (c = 0; c < spi->ncells; c++) {
+		cells[c] = spi->cells[keys[c].cell];
+		map[keys[c].cell] = c;
+	}
+	for (i = 0; i < spi->npoints; i++)
+		spi->pointcell[i] = map[spi->pointcell[i]];
+
+	free(spi->cells);
+	spi->cells = cells;
+	fill_buckets(spi);
+	free(map);
+	free(keys);
+}
+
+static void
+alloc_order(struct spi *spi)
+{
+	spi->order = xrealloc(spi->order,
+	    spi->norderalloc * sizeof *spi->order);
+	spi->sx = xrealloc(spi->sx, spi->norderalloc * sizeof *spi->sx);
+	spi->sy = xrealloc(spi->sy, spi->norderalloc * sizeof *spi->sy);
+	spi->sz = xrealloc(spi->sz, spi->norderalloc * sizeof *spi->sz);
+}
+
+/* put point idx into slot pos of the flat array */
+static void
+set_slot(struct spi *spi, int pos, int idx)
+{
+	const vec_t *xyz;
+
+	xyz = get_coords(spi) + idx;
+	spi->order[pos] = idx;
+	spi->pointpos[idx] = pos;
+	spi->sx[pos] = xyz->x;
+	spi->sy[pos] = xyz->y;
+	spi->sz[pos] = xyz->z;
+}
+
+static void
+build_cells(struct spi *spi, double dist)
+{
+	struct cell *cell;
+	vec_t pmin, pmax, wrapped;
+	double extent;
+	int i, c, start, xyz[3];
+
+	if (spi->is_periodic) {
+		for (i = 0; i < 3; i++)
+			spi->ngrid[i] = get_grid_size(spi, i, dist);
+		spi->origin = vec_zero();
+	} else {
+		calc_box(spi, &pmin, &pmax);
+
+		/* keep integer cell coordinates well within range */
+		extent = pmax.x - pmin.x;
+		if (pmax.y - pmin.y > extent) extent = pmax.y - pmin.y;
+		if (pmax.z - pmin.z > extent) extent = pmax.z - pmin.z;
+		if (dist < extent / 1.0e6)
+			dist = extent / 1.0e6;
+		if (dist < 1.0e-6)
+			dist = 1.0e-6;
+
+		spi->origin = pmin;
+	}
+	spi->cellsize = dist;
+
+	spi->nbuckets = 16;
+	while (spi->nbuckets < 2 * spi->npoints)
+		spi->nbuckets *= 2;
+	spi->buckets = xrealloc(spi->buckets,
+	    spi->nbuckets * sizeof *spi->buckets);
+	for (i = 0; i < spi->nbuckets; i++)
+		spi->buckets[i] = -1;
+
+	spi->ncells = 0;
+	spi->pointcell = xrealloc(spi->pointcell,
+	    spi->npointsalloc * sizeof *spi->pointcell);
+	spi->pointpos = xrealloc(spi->pointpos,
+	    spi->npointsalloc * sizeof *spi->pointpos);
+	spi->norderalloc = spi->npointsalloc;
+	alloc_order(spi);
+
+	for (i = 0; i < spi->npoints; i++) {
+		wrapped = locate_point(spi, spi->points[i], xyz);
+		if (spi->is_periodic)
+			spi->wrapped[i] = wrapped;
+		c = add_cell(spi, xyz[0], xyz[1], xyz[2]);
+		spi->pointcell[i] = c;
+		spi->cells[c].count++;
+	}
+	sort_cells(spi);
+
+	spi->cmin[0] = spi->cmin[1] = spi->cmin[2] = 0;
+	spi->cmax[0] = spi->cmax[1] = spi->cmax[2] = 0;
+
+	for (c = 0, start = 0; c < spi->ncells; c++) {
+		cell = spi->cells + c;
+		cell->start = start;
+		cell->cap = cell->count;
+		start += cell->count;
+		cell->count = 0;
+
+		if (cell->x > spi->cmax[0]) spi->cmax[0] = cell->x;
+		if (cell->y > spi->cmax[1]) spi->cmax[1] = cell->y;
+		if (cell->z > spi->cmax[2]) spi->cmax[2] = cell->z;
+	}
+
+	for (i = 0; i < spi->npoints; i++) {
+		cell = spi->cells + spi->pointcell[i];
+		set_slot(spi, cell->start + cell->count++, i);
+	}
+
+	spi->norder = spi->npoints;
+	spi->is_valid = 1;
+}
+
+static int
+find_point_cell(struct spi *spi, int idx)
+{
+	vec_t wrapped;
+	int c[3], i;
+
+	wrapped = locate_point(spi, spi->points[idx], c);
+	if (spi->is_periodic)
+		spi->wrapped[idx] = wrapped;
+
+	for (i = 0; i < 3; i++) {
+		if (c[i] < spi->cmin[i]) spi->cmin[i] = c[i];
+		if (c[i] > spi->cmax[i]) spi->cmax[i] = c[i];
+	}
+	return (add_cell(spi, c[0], c[1], c[2]));
+}
+
+/* move the slot range of a full cell to a larger one at the end */
+static void
+grow_cell(struct spi *spi, struct cell *cell)
+{
+	int i, cap;
+
+	cap = cell->cap < SPI_MIN_CELL_CAP ?
+	    SPI_MIN_CELL_CAP : 2 * cell->cap;
+
+	if (spi->norder + cap > spi->norderalloc) {
+		while (spi->norder + cap > spi->norderalloc)
+			spi->norderalloc *= 2;
+		alloc_order(spi);
+	}
+	for (i = 0; i < cell->count; i++)
+		set_slot(spi, spi->norder + i, spi->order[cell->start + i]);
+	cell->start = spi->norder;
+	cell->cap = cap;
+	spi->norder += cap;
+}
+
+static void
+insert_point(struct spi *spi, int idx, int c)
+{
+	struct cell *cell;
+
+	cell = spi->cells + c;
+
+	if (cell->count == cell->cap)
+		grow_cell(spi, cell);
+
+	spi->pointcell[idx] = c;
+	set_slot(spi, cell->start + cell->count++, idx);
+}
+
+static void
+delete_point(struct spi *spi, int idx)
+{
+	struct cell *cell;
+	int last;
+
+	cell = spi->cells + spi->pointcell[idx];
+	last = spi->order[cell->start + --cell->count];
+	set_slot(spi, spi->pointpos[idx], last);
+}
+
+/* rebuild on next use once most of the index is empty slots or cells */
+static void
+check_slack(struct spi *spi)
+{
+	if (spi->norder > 2 * spi->npoints + SPI_MAX_SLACK ||
+	    spi->ncells > 2 * spi->npoints + SPI_MAX_SLACK)
+		spi->is_valid = 0;
+}
+
+static void
+update_cells(struct spi *spi, double dist)
+{
+	int i;
+
+	if (!spi->is_valid) {
+		build_cells(spi, dist);
+		return;
+	}
+	if (spi->is_periodic) {
+		for (i = 0; i < 3; i++)
+			if (get_grid_size(spi, i, dist) != spi->ngrid[i]) {
+				build_cells(spi, dist);
+				return;
+			}
+	} else if (spi->cellsize < dist || spi->cellsize > 2.0 * dist)
+		build_cells(spi, dist);
+}
+
+static void
+check_cells(struct spi *spi)
+{
+	if (!spi->is_valid)
+		build_cells(spi, spi->cellsize > 0.0 ?
+		    spi->cellsize : SPI_DEFAULT_CELL_SIZE);
+}
+
+/*
+ * Test point xyz against n slots of the flat array starting at pos.  The
+ * offsets of slots closer than sqrt(r2) and their squared distances are
+ * stored in hit and hitd2, n must not exceed SPI_BLOCK.
+ */
+static int
+scan_block(struct spi *spi, int pos, int n, vec_t xyz, double r2, int *hit,
+    double *hitd2)
+{
+	const double *x, *y, *z;
+	double dx, dy, dz, d2;
+	int i, nhit = 0;
+#if defined(__AVX__)
+	__m256d px, py, pz, vr2, vx, vy, vz, vd2;
+	double buf[4];
+	int k, mask;
+#elif defined(__SSE2__)
+	__m128d px, py, pz, vr2, vx, vy, vz, vd2;
+	double buf[2];
+	int k, mask;
+#endif
+
+	x = spi->sx + pos;
+	y = spi->sy + pos;
+	z = spi->sz + pos;
+	i = 0;
+
+#if defined(__AVX__)
+	px = _mm256_set1_pd(xyz.x);
+	py = _mm256_set1_pd(xyz.y);
+	pz = _mm256_set1_pd(xyz.z);
+	vr2 = _mm256_set1_pd(r2);
+
+	for (; i + 4 <= n; i += 4) {
+		vx = _mm256_sub_pd(_mm256_loadu_pd(x + i), px);
+		vy = _mm256_sub_pd(_mm256_loadu_pd(y + i), py);
+		vz = _mm256_sub_pd(_mm256_loadu_pd(z + i), pz);
+		vd2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(vx, vx),
+		    _mm256_mul_pd(vy, vy)), _mm256_mul_pd(vz, vz));
+		mask = _mm256_movemask_pd(_mm256_cmp_pd(vd2, vr2,
+		    _CMP_LT_OQ));
+		if (mask == 0)
+			continue;
+		_mm256_storeu_pd(buf, vd2);
+		for (k = 0; k < 4; k++)
+			if (mask & (1 << k)) {
+				hit[nhit] = i + k;
+				hitd2[nhit++] = buf[k];
+			}
+	}
+#elif defined(__SSE2__)
+	px = _mm_set1_pd(xyz.x);
+	py = _mm_set1_pd(xyz.y);
+	pz = _mm_set1_pd(xyz.z);
+	vr2 = _mm_set1_pd(r2);
+
+	for (; i + 2 <= n; i += 2) {
+		vx = _mm_sub_pd(_mm_loadu_pd(x + i), px);
+		vy = _mm_sub_pd(_mm_loadu_pd(y + i), py);
+		vz = _mm_sub_pd(_mm_loadu_pd(z + i), pz);
+		vd2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(vx, vx),
+		    _mm_mul_pd(vy, vy)), _mm_mul_pd(vz, vz));
+		mask = _mm_movemask_pd(_mm_cmplt_pd(vd2, vr2));
+		if (mask == 0)
+			continue;
+		_mm_storeu_pd(buf, vd2);
+		for (k = 0; k < 2; k++)
+			if (mask & (1 << k)) {
+				hit[nhit] = i + k;
+				hitd2[nhit++] = buf[k];
+			}
+	}
+#endif
+	for (; i < n; i++) {
+		dx = x[i] - xyz.x;
+		dy = y[i] - xyz.y;
+		dz = z[i] - xyz.z;
+		d2 = dx * dx + dy * dy + dz * dz;
+		if (d2 < r2) {
+			hit[nhit] = i;
+			hitd2[nhit++] = d2;
+		}
+	}
+	return (nhit);
+}
+
+static void
+query_cell(struct spi *spi, struct cell *cell, vec_t xyz, double r2,
+    struct sel *sel)
+{
+	double hitd2[SPI_BLOCK];
+	int i, k, n, nhit, hit[SPI_BLOCK];
+
+	for (i = 0; i < cell->count; i += SPI_BLOCK) {
+		n = cell->count - i < SPI_BLOCK ? cell->count - i : SPI_BLOCK;
+		nhit = scan_block(spi, cell->start + i, n, xyz, r2, hit,
+		    hitd2);
+		for (k = 0; k < nhit; k++)
+			sel_add(sel, spi->order[cell->start + i + hit[k]]);
+	}
+}
+
+/* a bounded max-heap of the k nearest points found so far */
+struct nearest {
+	int k, count;
+	int *idx;
+	double *d2;
+};
+
+static void
+nearest_swap(struct nearest *nearest, int i, int j)
+{
+	double d2;
 	int idx;
 
-	if (xmax - xmin < 1.0e-6)
-		return (1);
+	idx = nearest->idx[i];
+	nearest->idx[i] = nearest->idx[j];
+	nearest->idx[j] = idx;
+	d2 = nearest->d2[i];
+	nearest->d2[i] = nearest->d2[j];
+	nearest->d2[j] = d2;
+}
 
-	idx = (int)((nx - 2) * (x - xmin) / (xmax - xmin));
+static void
+nearest_sift_down(struct nearest *nearest, int i)
+{
+	int j;
 
-	return (idx == nx - 2 ? idx : idx + 1);
+	while ((j = 2 * i + 1) < nearest->count) {
+		if (j + 1 < nearest->count &&
+		    nearest->d2[j + 1] > nearest->d2[j])
+			j++;
+		if (nearest->d2[i] >= nearest->d2[j])
+			break;
+		nearest_swap(nearest, i, j);
+		i = j;
+	}
 }
 
 static void
-calc_self(struct spi *spi, double dist, struct cell *c1)
+nearest_push(struct nearest *nearest, int idx, double d2)
 {
-	double r2;
-	vec_t xyz_i, xyz_j;
 	int i, j;
 
-	r2 = dist * dist;
+	if (nearest->count == nearest->k) {
+		if (d2 >= nearest->d2[0])
+			return;
+		nearest->idx[0] = idx;
+		nearest->d2[0] = d2;
+		nearest_sift_down(nearest, 0);
+		return;
+	}
+	i = nearest->count++;
+	nearest->idx[i] = idx;
+	nearest->d2[i] = d2;
+	while (i > 0) {
+		j = (i - 1) / 2;
+		if (nearest->d2[j] >= nearest->d2[i])
+			break;
+		nearest_swap(nearest, i, j);
+		i = j;
+	}
+}
+
+static void
+nearest_cell(struct spi *spi, struct nearest *nearest, struct cell *cell,
+    vec_t xyz)
+{
+	const vec_t *coords;
+	const int *idx;
+	int i;
+
+	coords = get_coords(spi);
+	idx = spi->order + cell->start;
+
+	for (i = 0; i < cell->count; i++)
+		nearest_push(nearest, idx[i],
+		    image_distsq(spi, &coords[idx[i]], &xyz));
+}
 
-	for (i = 0; i < c1->nelts; i++) {
-		for (j = i + 1; j < c1->nelts; j++) {
-			xyz_i = spi_get_point(spi, c1->data[i]);
-			xyz_j = spi_get_point(spi, c1->data[j]);
+/*
+ * Visit cells on the surface of a cube of cells with half-size m around
+ * cell c, clipped to the range of occupied cells.  A periodic index is not
+ * clipped; the caller keeps the cube smaller than the grid so that no cell
+ * is visited twice.
+ */
+static int
+nearest_ring(struct spi *spi, struct nearest *nearest, vec_t xyz,
+    const int *c, int m)
+{
+	int i, cell, count, lo[3], hi[3], d[3], e[3];
+	vec_t shift;
 
-			if (vec_distsq(&xyz_i, &xyz_j) < r2)
-				pairs_add(spi->pairs, c1->data[i], c1->data[j]);
+	for (i = 0; i < 3; i++) {
+		lo[i] = spi->cmin[i] - c[i] > -m ? spi->cmin[i] - c[i] : -m;
+		hi[i] = spi->cmax[i] - c[i] < m ? spi->cmax[i] - c[i] : m;
+		if (spi->is_periodic) {
+			lo[i] = -m;
+			hi[i] = m;
+		}
+	}
+	count = 0;
+	for (d[0] = lo[0]; d[0] <= hi[0]; d[0]++) {
+		for (d[1] = lo[1]; d[1] <= hi[1]; d[1]++) {
+			for (d[2] = lo[2]; d[2] <= hi[2]; d[2]++) {
+				if (d[0] != -m && d[0] != m &&
+				    d[1] != -m && d[1] != m &&
+				    d[2] != -m && d[2] != m)
+					continue;
+				for (i = 0; i < 3; i++)
+					e[i] = c[i] + d[i];
+				cell = find_image_cell(spi, e, &shift);
+				if (cell == -1)
+					continue;
+				nearest_cell(spi, nearest, spi->cells + cell,
+				    xyz);
+				count += spi->cells[cell].count;
+			}
 		}
 	}
+	return (count);
 }
 
 static void
-calc_cell(struct spi *spi, double dist, struct cell *c1, struct cell *c2)
+add_pair(struct spi *spi, struct pairs *pairs, int i, int j, double d2)
 {
-	double r2;
-	vec_t xyz_i, xyz_j;
-	int i, j;
+	if (spi->filter == NULL || spi->filter(spi->filterdata, i, j, d2))
+		pairs_add(pairs, i, j);
+}
+
+/* pairs of point idx at xyz with the points in slots start to end */
+static void
+calc_slots(struct spi *spi, struct pairs *pairs, int idx, vec_t xyz,
+    int start, int end)
+{
+	double hitd2[SPI_BLOCK];
+	int i, k, n, nhit, hit[SPI_BLOCK];
+
+	for (i = start; i < end; i += SPI_BLOCK) {
+		n = end - i < SPI_BLOCK ? end - i : SPI_BLOCK;
+		nhit = scan_block(spi, i, n, xyz, spi->r2, hit, hitd2);
+		for (k = 0; k < nhit; k++)
+			add_pair(spi, pairs, idx, spi->order[i + hit[k]],
+			    hitd2[k]);
+	}
+}
+
+static void
+calc_self(struct spi *spi, struct pairs *pairs, struct cell *c1)
+{
+	vec_t xyz;
+	int i, end;
 
-	r2 = dist * dist;
+	end = c1->start + c1->count;
 
-	for (i = 0; i < c1->nelts; i++) {
-		for (j = 0; j < c2->nelts; j++) {
-			xyz_i = spi_get_point(spi, c1->data[i]);
-			xyz_j = spi_get_point(spi, c2->data[j]);
+	for (i = c1->start; i < end; i++) {
+		xyz.x = spi->sx[i];
+		xyz.y = spi->sy[i];
+		xyz.z = spi->sz[i];
+		calc_slots(spi, pairs, spi->order[i], xyz, i + 1, end);
+	}
+}
+
+/* points of c2 are taken at their image shifted by shift */
+static void
+calc_cell(struct spi *spi, struct pairs *pairs, struct cell *c1,
+    struct cell *c2, vec_t shift)
+{
+	vec_t xyz;
+	int i;
+
+	for (i = c1->start; i < c1->start + c1->count; i++) {
+		xyz.x = spi->sx[i] - shift.x;
+		xyz.y = spi->sy[i] - shift.y;
+		xyz.z = spi->sz[i] - shift.z;
+		calc_slots(spi, pairs, spi->order[i], xyz, c2->start,
+		    c2->start + c2->count);
+	}
+}
+
+/*
+ * Each job sweeps a contiguous range of cells into its own pair buffer.
+ * Buffers are concatenated in job order, so the result does not depend on
+ * the number of threads.
+ */
+static void
+calc_chunk(void *data, int chunk)
+{
+	struct spi *spi = data;
+	struct pairs *pairs;
+	struct cell *c1;
+	vec_t shift;
+	int c, c2, k, start, end, xyz[3];
+
+	pairs = spi->chunks[chunk];
+	pairs_clear(pairs);
+	start = (int)((long long)spi->ncells * chunk / spi->nchunks);
+	end = (int)((long long)spi->ncells * (chunk + 1) / spi->nchunks);
+
+	for (c = start; c < end; c++) {
+		c1 = spi->cells + c;
+		calc_self(spi, pairs, c1);
+
+		for (k = 0; k < 13; k++) {
+			xyz[0] = c1->x + shell[k][0];
+			xyz[1] = c1->y + shell[k][1];
+			xyz[2] = c1->z + shell[k][2];
+			c2 = find_image_cell(spi, xyz, &shift);
+			if (c2 != -1)
+				calc_cell(spi, pairs, c1, spi->cells + c2,
+				    shift);
+		}
+	}
+}
+
+/*
+ * A unit cell less than two search distances wide can hold a pair at more
+ * than one image, which the cell sweep would report twice.  The cells
+ * around each cell are collected without repeats instead, and each pair
+ * of points is taken once at its closest image.
+ */
+static void
+calc_image_chunk(void *data, int chunk)
+{
+	struct spi *spi = data;
+	struct pairs *pairs;
+	struct cell *c1, *c2;
+	const vec_t *coords;
+	vec_t shift;
+	double d2;
+	int c, i, j, k, n, start, end, xyz[3], near[27];
+
+	pairs = spi->chunks[chunk];
+	pairs_clear(pairs);
+	coords = get_coords(spi);
+	start = (int)((long long)spi->ncells * chunk / spi->nchunks);
+	end = (int)((long long)spi->ncells * (chunk + 1) / spi->nchunks);
 
-			if (vec_distsq(&xyz_i, &xyz_j) < r2)
-				pairs_add(spi->pairs, c1->data[i], c2->data[j]);
+	for (c = start; c < end; c++) {
+		c1 = spi->cells + c;
+		n = 0;
+
+		for (k = 0; k < 27; k++) {
+			xyz[0] = c1->x + k / 9 - 1;
+			xyz[1] = c1->y + k / 3 % 3 - 1;
+			xyz[2] = c1->z + k % 3 - 1;
+			/* each pair of cells is visited from the lower one */
+			if ((near[n] = find_image_cell(spi, xyz,
+			    &shift)) < c)
+				continue;
+			for (i = 0; i < n; i++)
+				if (near[i] == near[n])
+					break;
+			if (i == n)
+				n++;
+		}
+		for (k = 0; k < n; k++) {
+			c2 = spi->cells + near[k];
+
+			for (i = c1->start; i < c1->start + c1->count; i++)
+				for (j = c2 == c1 ? i + 1 : c2->start;
+				    j < c2->start + c2->count; j++)
+					if ((d2 = image_distsq(spi,
+					    &coords[spi->order[i]],
+					    &coords[spi->order[j]])) < spi->r2)
+						add_pair(spi, pairs,
+						    spi->order[i],
+						    spi->order[j], d2);
 		}
 	}
 }
 
+static void
+set_chunk_count(struct spi *spi, int nchunks)
+{
+	int i;
+
+	if (nchunks > spi->nchunksalloc) {
+		spi->chunks = xrealloc(spi->chunks,
+		    nchunks * sizeof *spi->chunks);
+		for (i = spi->nchunksalloc; i < nchunks; i++)
+			spi->chunks[i] = pairs_create();
+		spi->nchunksalloc = nchunks;
+	}
+	spi->nchunks = nchunks;
+}
+
 struct spi *
 spi_create(void)
 {
@@ -131,6 +1002,8 @@ spi_create(void)
 	spi = xcalloc(1, sizeof *spi);
 	spi->npointsalloc = 8;
 	spi->points = xcalloc(spi->npointsalloc, sizeof *spi->points);
+	spi->ncellsalloc = 8;
+	spi->cells = xcalloc(spi->ncellsalloc, sizeof *spi->cells);
 	spi->pairs = pairs_create();
 
 	return (spi);
@@ -139,13 +1012,64 @@ spi_create(void)
 void
 spi_free(struct spi *spi)
 {
+	int i;
+
 	if (spi) {
 		pairs_free(spi->pairs);
+		for (i = 0; i < spi->nchunksalloc; i++)
+			pairs_free(spi->chunks[i]);
+		free(spi->chunks);
 		free(spi->points);
+		free(spi->wrapped);
+		free(spi->cells);
+		free(spi->buckets);
+		free(spi->pointcell);
+		free(spi->pointpos);
+		free(spi->order);
+		free(spi->sx);
+		free(spi->sy);
+		free(spi->sz);
 		free(spi);
 	}
 }
 
+void
+spi_set_lattice(struct spi *spi, const vec_t *abc)
+{
+	vec_t *recip;
+	double vol;
+	int i;
+
+	spi->is_valid = 0;
+	spi->is_periodic = 0;
+
+	if (abc == NULL)
+		return;
+
+	recip = spi->recip;
+	recip[0] = vec_cross(&abc[1], &abc[2]);
+	recip[1] = vec_cross(&abc[2], &abc[0]);
+	recip[2] = vec_cross(&abc[0], &abc[1]);
+
+	if ((vol = vec_dot(&abc[0], &recip[0])) == 0.0)
+		return;
+
+	spi->halfwidth2 = 0.0;
+
+	for (i = 0; i < 3; i++) {
+		spi->lattice[i] = abc[i];
+		vec_scale(&recip[i], 1.0 / vol);
+		spi->width[i] = 1.0 / vec_len(&recip[i]);
+
+		if (i == 0 || spi->width[i] * spi->width[i] / 4.0 <
+		    spi->halfwidth2)
+			spi->halfwidth2 = spi->width[i] * spi->width[i] / 4.0;
+	}
+	spi->wrapped = xrealloc(spi->wrapped,
+	    spi->npointsalloc * sizeof *spi->wrapped);
+	spi->is_periodic = 1;
+}
+
 void
 spi_add_point(struct spi *spi, vec_t xyz)
 {
@@ -153,9 +1077,103 @@ spi_add_point(struct spi *spi, vec_t xyz)
 		spi->npointsalloc *= 2;
 		spi->points = xrealloc(spi->points,
 		    spi->npointsalloc * sizeof *spi->points);
+		spi->pointcell = xrealloc(spi->pointcell,
+		    spi->npointsalloc * sizeof *spi->pointcell);
+		spi->pointpos = xrealloc(spi->pointpos,
+		    spi->npointsalloc * sizeof *spi->pointpos);
+		if (spi->is_periodic)
+			spi->wrapped = xrealloc(spi->wrapped,
+			    spi->npointsalloc * sizeof *spi->wrapped);
 	}
 	spi->points[spi->npoints] = xyz;
 	spi->npoints++;
+
+	if (spi->is_valid) {
+		insert_point(spi, spi->npoints - 1,
+		    find_point_cell(spi, spi->npoints - 1));
+		check_slack(spi);
+	}
+}
+
+void
+spi_set_point(struct spi *spi, int idx, vec_t xyz)
+{
+	int c;
+
+	assert(idx >= 0 && idx < spi_get_point_count(spi));
+
+	spi->points[idx] = xyz;
+
+	if (spi->is_valid) {
+		if ((c = find_point_cell(spi, idx)) == spi->pointcell[idx]) {
+			set_slot(spi, spi->pointpos[idx], idx);
+			return;
+		}
+		delete_point(spi, idx);
+		insert_point(spi, idx, c);
+		check_slack(spi);
+	}
+}
+
+void
+spi_remove_point(struct spi *spi, int idx)
+{
+	int i;
+
+	assert(idx >= 0 && idx < spi_get_point_count(spi));
+
+	if (spi->is_valid)
+		delete_point(spi, idx);
+
+	for (i = idx; i < spi->npoints - 1; i++) {
+		spi->points[i] = spi->points[i + 1];
+
+		if (spi->is_valid) {
+			if (spi->is_periodic)
+				spi->wrapped[i] = spi->wrapped[i + 1];
+			spi->pointcell[i] = spi->pointcell[i + 1];
+			spi->pointpos[i] = spi->pointpos[i + 1];
+			spi->order[spi->pointpos[i]] = i;
+		}
+	}
+	spi->npoints--;
+
+	if (spi->is_valid)
+		check_slack(spi);
+}
+
+/*
+ * Remove many points at once.  The map gives the new index of each point
+ * or -1 for points to remove, kept points must keep their order.
+ */
+void
+spi_remove_many(struct spi *spi, const int *map)
+{
+	int i, n;
+
+	if (spi->is_valid)
+		for (i = 0; i < spi->npoints; i++)
+			if (map[i] == -1)
+				delete_point(spi, i);
+
+	for (i = 0, n = 0; i < spi->npoints; i++) {
+		if (map[i] == -1)
+			continue;
+		spi->points[n] = spi->points[i];
+
+		if (spi->is_valid) {
+			if (spi->is_periodic)
+				spi->wrapped[n] = spi->wrapped[i];
+			spi->pointcell[n] = spi->pointcell[i];
+			spi->pointpos[n] = spi->pointpos[i];
+			spi->order[spi->pointpos[n]] = n;
+		}
+		n++;
+	}
+	spi->npoints = n;
+
+	if (spi->is_valid)
+		check_slack(spi);
 }
 
 int
@@ -176,80 +1194,45 @@ void
 spi_clear(struct spi *spi)
 {
 	spi->npoints = 0;
+	spi->is_valid = 0;
 }
 
 void
 spi_compute(struct spi *spi, double dist)
 {
-	struct cell *cells;
-	int ncells;
-	vec_t pmin, pmax, xyz;
-	int i, ix, iy, iz, nx, ny, nz, c1, c2;
+	spi_compute_filter(spi, dist, NULL, NULL);
+}
 
-	pairs_clear(spi->pairs);
-	calc_box(spi, &pmin, &pmax);
+/*
+ * Find pairs closer than dist and keep those for which filter returns
+ * nonzero.  The filter gets the indices and the squared distance and may
+ * be called from several threads at once.
+ */
+void
+spi_compute_filter(struct spi *spi, double dist,
+    int (*filter)(void *, int, int, double), void *data)
+{
+	int i, nchunks;
 
-	nx = get_cell_count(pmax.x - pmin.x, dist);
-	ny = get_cell_count(pmax.y - pmin.y, dist);
-	nz = get_cell_count(pmax.z - pmin.z, dist);
+	pairs_clear(spi->pairs);
+	update_cells(spi, dist);
+	spi->r2 = dist * dist;
+	spi->filter = filter;
+	spi->filterdata = data;
 
-	ncells = nx * ny * nz;
-	cells = xcalloc(ncells, sizeof *cells);
+	nchunks = spi->ncells / SPI_CHUNK_CELLS;
+	nchunks = nchunks < 1 ? 1 : nchunks > SPI_MAX_CHUNKS ?
+	    SPI_MAX_CHUNKS : nchunks;
+	set_chunk_count(spi, nchunks);
 
-	for (i = 0; i < ncells; i++) {
-		cells[i].nalloc = 8;
-		cells[i].data = xcalloc(cells[i].nalloc, sizeof *cells->data);
-	}
+	if (spi->is_periodic && (spi->ngrid[0] < 2 || spi->ngrid[1] < 2 ||
+	    spi->ngrid[2] < 2))
+		pool_run(calc_image_chunk, spi, nchunks);
+	else
+		pool_run(calc_chunk, spi, nchunks);
 
-	for (i = 0; i < spi_get_point_count(spi); i++) {
-		xyz = spi_get_point(spi, i);
-
-		ix = get_cell_idx(xyz.x, pmin.x, pmax.x, nx);
-		iy = get_cell_idx(xyz.y, pmin.y, pmax.y, ny);
-		iz = get_cell_idx(xyz.z, pmin.z, pmax.z, nz);
-
-		c1 = CIDX(ix, iy, iz);
-		cell_add_idx(&cells[c1], i);
-	}
-
-	for (ix = 1; ix < nx - 1; ix++) {
-		for (iy = 1; iy < ny - 1; iy++) {
-			for (iz = 1; iz < nz - 1; iz++) {
-				c1 = CIDX(ix, iy, iz);
-				calc_self(spi, dist, &cells[c1]);
-				c2 = CIDX(ix, iy, iz + 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix, iy + 1, iz - 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix, iy + 1, iz);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix, iy + 1, iz + 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy - 1, iz - 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy - 1, iz);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy - 1, iz + 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy, iz - 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy, iz);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy, iz + 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy + 1, iz - 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy + 1, iz);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-				c2 = CIDX(ix + 1, iy + 1, iz + 1);
-				calc_cell(spi, dist, &cells[c1], &cells[c2]);
-			}
-		}
-	}
-
-	for (i = 0; i < ncells; i++)
-		free(cells[i].data);
-	free(cells);
+	for (i = 0; i < nchunks; i++)
+		pairs_append(spi->pairs, spi->chunks[i]);
 }
 
 int
@@ -263,3 +1246,132 @@ spi_get_pair(struct spi *spi, int idx)
 {
 	return (pairs_get(spi->pairs, idx));
 }
+
+void
+spi_query_radius(struct spi *spi, vec_t xyz, double radius, struct sel *sel)
+{
+	const vec_t *coords;
+	vec_t shift, image;
+	double r2, ncheck, ncell[3];
+	int i, c, m[3], d[3], e[3], q[3];
+
+	assert(sel_get_size(sel) >= spi_get_point_count(spi));
+
+	check_cells(spi);
+	coords = get_coords(spi);
+	r2 = radius * radius;
+	ncheck = 1.0;
+
+	/* cells to look at on each side, kept in double until known small */
+	for (i = 0; i < 3; i++) {
+		ncell[i] = ceil(radius / spi->cellsize);
+		if (spi->is_periodic) {
+			ncell[i] = ceil(radius * spi->ngrid[i] /
+			    spi->width[i]);
+			/* a cell would be visited more than once */
+			if (2.0 * ncell[i] + 1 > spi->ngrid[i])
+				ncheck = HUGE_VAL;
+		}
+		ncheck *= 2.0 * ncell[i] + 1;
+	}
+
+	/* cheaper to look at every occupied cell */
+	if (!(ncheck <= spi->ncells)) {
+		for (i = 0; i < spi->npoints; i++)
+			if (image_distsq(spi, &coords[i], &xyz) < r2)
+				sel_add(sel, i);
+		return;
+	}
+
+	for (i = 0; i < 3; i++)
+		m[i] = (int)ncell[i];
+
+	xyz = locate_point(spi, xyz, q);
+
+	for (d[0] = -m[0]; d[0] <= m[0]; d[0]++)
+		for (d[1] = -m[1]; d[1] <= m[1]; d[1]++)
+			for (d[2] = -m[2]; d[2] <= m[2]; d[2]++) {
+				for (i = 0; i < 3; i++)
+					e[i] = q[i] + d[i];
+				if ((c = find_image_cell(spi, e,
+				    &shift)) == -1)
+					continue;
+				image = vec_sub(&xyz, &shift);
+				query_cell(spi, spi->cells + c, image,
+				    r2, sel);
+			}
+}
+
+int
+spi_query_nearest(struct spi *spi, vec_t xyz, int k, int *idx)
+{
+	struct nearest nearest;
+	double d, ncheck;
+	int i, m, mmin, mmax, nseen, c[3];
+
+	if (k > spi_get_point_count(spi))
+		k = spi_get_point_count(spi);
+	if (k < 1)
+		return (0);
+
+	check_cells(spi);
+	nearest.k = k;
+	nearest.count = 0;
+	nearest.idx = idx;
+	nearest.d2 = xcalloc(k, sizeof *nearest.d2);
+
+	xyz = locate_point(spi, xyz, c);
+
+	/* rings between mmin and mmax intersect occupied cells */
+	mmin = mmax = 0;
+	for (i = 0; i < 3; i++) {
+		if (spi->cmin[i] - c[i] > mmin) mmin = spi->cmin[i] - c[i];
+		if (c[i] - spi->cmax[i] > mmin) mmin = c[i] - spi->cmax[i];
+		if (c[i] - spi->cmin[i] > mmax) mmax = c[i] - spi->cmin[i];
+		if (spi->cmax[i] - c[i] > mmax) mmax = spi->cmax[i] - c[i];
+	}
+
+	/*
+	 * Images of occupied cells can be close across a face of the unit
+	 * cell, so start from the first ring.  No cell may be visited twice.
+	 */
+	if (spi->is_periodic) {
+		mmin = 0;
+		mmax = spi->ngrid[0];
+		for (i = 0; i < 3; i++)
+			if ((spi->ngrid[i] - 1) / 2 < mmax)
+				mmax = (spi->ngrid[i] - 1) / 2;
+	}
+
+	/*
+	 * Points in rings beyond m are more than m cells away, so stop once
+	 * the k-th nearest point found so far is closer than that.
+	 */
+	nseen = 0;
+	for (m = mmin; nseen < spi->npoints; m++) {
+		ncheck = (2.0 * m + 1) * (2.0 * m + 1) * 6.0;
+		if (m > mmax || ncheck > spi->ncells) {
+			nearest.count = 0;
+			for (i = 0; i < spi->ncells; i++)
+				nearest_cell(spi, &nearest, spi->cells + i,
+				    xyz);
+			break;
+		}
+		nseen += nearest_ring(spi, &nearest, xyz, c, m);
+		if (nearest.count == k) {
+			d = m * spi->cellsize;
+			if (nearest.d2[0] <= d * d)
+				break;
+		}
+	}
+
+	/* heap to ascending order */
+	while (nearest.count > 1) {
+		nearest_swap(&nearest, 0, nearest.count - 1);
+		nearest.count--;
+		nearest_sift_down(&nearest, 0);
+	}
+
+	free(nearest.d2);
+	return (k);
+}
@@ -29,7 +29,16 @@ struct state {
 	struct tabs *tabs;
 	struct yank *yank;
 	SDL_Window *window;
+	SDL_Surface *surface;   /* window surface cairo was created for */
+	int is_direct;          /* cairo draws into the window pixels */
 	cairo_t *cairo;
+	int is_exposed;         /* window needs presenting again */
+	int is_scene_dirty;
+	struct view *sceneview; /* what the last scene was drawn from */
+	version_t scenekey[6];
+	int is_statusbar_shown;
+	version_t statusbarkey[2];
+	version_t statusbarfont;    /* font settings the strip was sized for */
 };
 
 static void
@@ -62,22 +71,39 @@ create_window(struct state *state)
 		fatal("%s", SDL_GetError());
 }
 
+/*
+ * A new window surface is handed out when the window size changes.  SDL
+ * may reuse the address of the old one, so when cairo draws straight into
+ * the window pixels those are compared as well.
+ */
 static int
 window_is_resized(struct state *state)
 {
 	SDL_Surface *sdl_surface;
-	cairo_surface_t *cairo_surface;
-	int w, h;
+	cairo_surface_t *target;
 
-	if ((cairo_surface = cairo_get_target(state->cairo)) == NULL)
-		fatal("cairo_get_target");
 	if ((sdl_surface = SDL_GetWindowSurface(state->window)) == NULL)
 		fatal("%s", SDL_GetError());
 
-	w = cairo_image_surface_get_width(cairo_surface);
-	h = cairo_image_surface_get_height(cairo_surface);
+	target = cairo_get_target(state->cairo);
+
+	return (sdl_surface != state->surface ||
+	    sdl_surface->w != cairo_image_surface_get_width(target) ||
+	    sdl_surface->h != cairo_image_surface_get_height(target) ||
+	    (state->is_direct &&
+	    sdl_surface->pixels != cairo_image_surface_get_data(target)));
+}
+
+/* whether cairo can draw straight into the pixels of a surface */
+static int
+is_direct_format(SDL_Surface *sdl_surface)
+{
+	SDL_PixelFormat *format = sdl_surface->format;
 
-	return (sdl_surface->w != w || sdl_surface->h != h);
+	return (format->BytesPerPixel == 4 && format->Rmask == 0xff0000 &&
+	    format->Gmask == 0xff00 && format->Bmask == 0xff &&
+	    !SDL_MUSTLOCK(sdl_surface) && sdl_surface->pitch ==
+	    cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, sdl_surface->w));
 }
 
 static void
@@ -92,8 +118,17 @@ create_cairo(struct state *state)
 	if ((sdl_surface = SDL_GetWindowSurface(state->window)) == NULL)
 		fatal("%s", SDL_GetError());
 
-	cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
-	    sdl_surface->w, sdl_surface->h);
+	state->surface = sdl_surface;
+	state->is_direct = is_direct_format(sdl_surface);
+	state->is_scene_dirty = 1;
+
+	if (state->is_direct)
+		cairo_surface = cairo_image_surface_create_for_data(
+		    sdl_surface->pixels, CAIRO_FORMAT_RGB24,
+		    sdl_surface->w, sdl_surface->h, sdl_surface->pitch);
+	else
+		cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+		    sdl_surface->w, sdl_surface->h);
 	if (cairo_surface_status(cairo_surface) != CAIRO_STATUS_SUCCESS)
 		fatal("unable to create cairo surface");
 
@@ -108,22 +143,27 @@ create_cairo(struct state *state)
 static void
 state_blit(struct state *state)
 {
-	SDL_Surface *sdl_surface;
+	SDL_Surface *sdl_surface = state->surface;
 	cairo_surface_t *cairo_surface;
 	unsigned char *data;
+	int y, stride, size;
 
-	if (window_is_resized(state))
-		fatal("unexpected window size");
 	if ((cairo_surface = cairo_get_target(state->cairo)) == NULL)
 		fatal("cairo_get_target");
-	if ((sdl_surface = SDL_GetWindowSurface(state->window)) == NULL)
-		fatal("%s", SDL_GetError());
 
 	cairo_surface_flush(cairo_surface);
-	data = cairo_image_surface_get_data(cairo_surface);
-	SDL_LockSurface(sdl_surface);
-	memcpy(sdl_surface->pixels, data, sdl_surface->pitch * sdl_surface->h);
-	SDL_UnlockSurface(sdl_surface);
+
+	if (!state->is_direct) {
+		data = cairo_image_surface_get_data(cairo_surface);
+		stride = cairo_image_surface_get_stride(cairo_surface);
+		size = stride < sdl_surface->pitch ? stride :
+		    sdl_surface->pitch;
+		SDL_LockSurface(sdl_surface);
+		for (y = 0; y < sdl_surface->h; y++)
+			memcpy((unsigned char *)sdl_surface->pixels +
+			    y * sdl_surface->pitch, data + y * stride, size);
+		SDL_UnlockSurface(sdl_surface);
+	}
 	SDL_UpdateWindowSurface(state->window);
 }
 
@@ -148,6 +188,7 @@ set_statusbar_text(struct state *state)
 	struct sys *sys = view_get_sys(view);
 	char buf[BUFSIZ];
 	const char *filename;
+	size_t undomem;
 
 	if (state->is_search)
 		statusbar_set_text(state->statusbar, "(search %s ):%s",
@@ -161,6 +202,9 @@ set_statusbar_text(struct state *state)
 		snprintf(buf, sizeof buf, "%d ", state->index);
 	if (rec_is_recording(state->rec))
 		snprintf(buf + strlen(buf), sizeof buf - strlen(buf), "rec ");
+	if ((undomem = view_get_undo_memory(view)) >= 1024 * 1024)
+		snprintf(buf + strlen(buf), sizeof buf - strlen(buf),
+		    "undo %.1fM ", (double)undomem / (1024 * 1024));
 	if (sys_is_modified(sys))
 		snprintf(buf + strlen(buf), sizeof buf - strlen(buf), "*");
 	filename = util_basename(view_get_path(view));
@@ -398,6 +442,9 @@ process_event(struct state *state, SDL_Event *event)
 		else
 			key_down_view(state, event->key.keysym);
 		break;
+	case SDL_WINDOWEVENT:
+		state->is_exposed = 1;
+		break;
 	case SDL_TEXTINPUT:
 		if (strlen(event->text.text) == 1)
 			edit_insert_char(state->edit, event->text.text[0]);
@@ -514,18 +561,60 @@ state_source(struct state *state, const char *path)
 	return (1);
 }
 
+/* check whether anything the scene is drawn from has changed */
+static void
+check_scene(struct state *state)
+{
+	struct view *view;
+	struct sys *sys;
+	version_t scene[6];
+
+	view = state_get_view(state);
+	sys = view_get_sys(view);
+	scene[0] = camera_get_version(view_get_camera(view));
+	scene[1] = sys_get_topology_version(sys);
+	scene[2] = sys_get_xyz_version(sys);
+	scene[3] = sys_get_sel_version(sys);
+	scene[4] = sys_get_visible_version(sys);
+	scene[5] = settings_get_other_version("statusbar-");
+
+	if (view != state->sceneview ||
+	    memcmp(scene, state->scenekey, sizeof scene) != 0) {
+		state->sceneview = view;
+		memcpy(state->scenekey, scene, sizeof scene);
+		state->is_scene_dirty = 1;
+	}
+	if (view_get_refresh_delay(view) == 0)
+		state->is_scene_dirty = 1;
+}
+
+/*
+ * Redraw what has changed since the last frame.  The scene is kept when
+ * only the status bar changes, as the status bar covers the same area
+ * every time it is drawn.  The area follows the font, so a font change
+ * redraws the scene as well.
+ */
 void
 state_render(struct state *state)
 {
-	int pos;
+	version_t statusbar[2], font;
+	int pos, is_shown, is_statusbar_dirty;
 
 	if (window_is_resized(state))
 		create_cairo(state);
 
-	if (!state->is_search && !state->is_input)
-		view_render(state_get_view(state), state->cairo);
+	is_shown = settings_get_bool("statusbar-visible");
+	if (state->is_statusbar_shown && !is_shown)
+		state->is_scene_dirty = 1;
+	font = settings_get_prefix_version("statusbar-font");
+	if (font != state->statusbarfont) {
+		state->statusbarfont = font;
+		state->is_scene_dirty = 1;
+	}
+	check_scene(state);
 
-	if (settings_get_bool("statusbar-visible")) {
+	is_statusbar_dirty = 0;
+	if (is_shown) {
 		set_statusbar_text(state);
 		pos = edit_get_pos(state->edit);
 
@@ -536,10 +625,28 @@ state_render(struct state *state)
 		else
 			statusbar_set_cursor_pos(state->statusbar, -1);
 
-		statusbar_render(state->statusbar, state->cairo);
+		statusbar[0] = statusbar_get_version(state->statusbar);
+		statusbar[1] = settings_get_prefix_version("statusbar-");
+		is_statusbar_dirty = !state->is_statusbar_shown ||
+		    memcmp(statusbar, state->statusbarkey, sizeof statusbar) != 0;
+		memcpy(state->statusbarkey, statusbar, sizeof statusbar);
 	}
+	state->is_statusbar_shown = is_shown;
+
+	if (!state->is_scene_dirty && !is_statusbar_dirty &&
+	    !state->is_exposed)
+		return;
+
+	if (state->is_scene_dirty) {
+		view_render(state_get_view(state), state->cairo);
+		is_statusbar_dirty = is_shown;
+		state->is_scene_dirty = 0;
+	}
+	if (is_statusbar_dirty)
+		statusbar_render(state->statusbar, state->cairo);
 
 	state_blit(state);
+	state->is_exposed = 0;
 }
 
 void
@@ -571,9 +678,16 @@ void
 state_event_loop(struct state *state)
 {
 	SDL_Event event;
+	int delay;
 
 	for (;;) {
-		SDL_WaitEvent(NULL);
+		/* wake up to redraw a simplified view at full quality */
+		delay = view_get_refresh_delay(state_get_view(state));
+
+		if (delay < 0)
+			SDL_WaitEvent(NULL);
+		else
+			SDL_WaitEventTimeout(NULL, delay);
 
 		while (SDL_PollEvent(&event))
 			if (!process_event(state, &event))
@@ -21,14 +21,39 @@ struct statusbar {
 	int cursor_pos;
 	char text[1024];
 	char info[1024];
+	version_t version;
 };
 
+static void
+set_text(struct statusbar *statusbar, char *dst, size_t size,
+    const char *fmt, va_list ap)
+{
+	char buf[1024];
+
+	vsnprintf(buf, sizeof buf, fmt, ap);
+
+	if (strcmp(dst, buf) != 0) {
+		snprintf(dst, size, "%s", buf);
+		statusbar->version = util_next_version();
+	}
+}
+
+static void
+set_error(struct statusbar *statusbar, int is_error)
+{
+	if (statusbar->is_error != is_error) {
+		statusbar->is_error = is_error;
+		statusbar->version = util_next_version();
+	}
+}
+
 struct statusbar *
 statusbar_create(void)
 {
 	struct statusbar *statusbar;
 
 	statusbar = xcalloc(1, sizeof *statusbar);
+	statusbar->version = util_next_version();
 
 	return (statusbar);
 }
@@ -50,10 +75,10 @@ statusbar_set_text(struct statusbar *statusbar, const char *fmt, ...)
 {
 	va_list ap;
 
-	statusbar->is_error = 0;
+	set_error(statusbar, 0);
 
 	va_start(ap, fmt);
-	vsnprintf(statusbar->text, sizeof statusbar->text, fmt, ap);
+	set_text(statusbar, statusbar->text, sizeof statusbar->text, fmt, ap);
 	va_end(ap);
 }
 
@@ -62,17 +87,20 @@ statusbar_set_error(struct statusbar *statusbar, const char *fmt, ...)
 {
 	va_list ap;
 
-	statusbar->is_error = 1;
+	set_error(statusbar, 1);
 
 	va_start(ap, fmt);
-	vsnprintf(statusbar->text, sizeof statusbar->text, fmt, ap);
+	set_text(statusbar, statusbar->text, sizeof statusbar->text, fmt, ap);
 	va_end(ap);
 }
 
 void
 statusbar_clear_text(struct statusbar *statusbar)
 {
-	statusbar->text[0] = '\0';
+	if (statusbar->text[0] != '\0') {
+		statusbar->text[0] = '\0';
+		statusbar->version = util_next_version();
+	}
 }
 
 const char *
@@ -87,20 +115,32 @@ statusbar_set_info_text(struct statusbar *statusbar, const char *fmt, ...)
 	va_list ap;
 
 	va_start(ap, fmt);
-	vsnprintf(statusbar->info, sizeof statusbar->info, fmt, ap);
+	set_text(statusbar, statusbar->info, sizeof statusbar->info, fmt, ap);
 	va_end(ap);
 }
 
 void
 statusbar_clear_info_text(struct statusbar *statusbar)
 {
-	statusbar->info[0] = '\0';
+	if (statusbar->info[0] != '\0') {
+		statusbar->info[0] = '\0';
+		statusbar->version = util_next_version();
+	}
 }
 
 void
 statusbar_set_cursor_pos(struct statusbar *statusbar, int value)
 {
-	statusbar->cursor_pos = value;
+	if (statusbar->cursor_pos != value) {
+		statusbar->cursor_pos = value;
+		statusbar->version = util_next_version();
+	}
+}
+
+version_t
+statusbar_get_version(struct statusbar *statusbar)
+{
+	return (statusbar->version);
 }
 
 void
@@ -22,6 +22,66 @@ struct sys {
 	struct graph *graph;
 	struct sel *sel;
 	struct sel *visible;
+	struct spi *spi;    /* built on demand for the current frame */
+	struct pairs *nblist;   /* bond candidates for per-frame bonds */
+	vec_t *nbxyz;       /* positions the candidates were found for */
+	version_t nbversion;
+	vec_t nbcell[3];
+	int nbperiodic;
+	double nbdist, nbskin;
+	struct undo *undo;  /* where changes are logged, NULL if nowhere */
+	struct sel *lastsel;    /* its changes are the last undo record */
+	version_t laststep; /* undo step of that record */
+	int nlastsel;       /* changes in that record */
+};
+
+/* kinds of changes kept in the undo log */
+enum {
+	CHANGE_ADD,         /* atoms appended */
+	CHANGE_REMOVE,      /* atoms removed */
+	CHANGE_NAME,
+	CHANGE_XYZ,
+	CHANGE_BOND,
+	CHANGE_BONDS,       /* all bonds replaced */
+	CHANGE_SEL          /* selection or visible atoms, state records */
+};
+
+/*
+ * Added atoms are followed by their coordinates and names.  Removed atoms
+ * are followed by their coordinates in every frame, their indices, their
+ * bonds as index-index-type triples and their names.  They are taken out
+ * of the selection and the visible atoms before they are removed.
+ */
+struct change_atoms {
+	int type, n, nframes, nbonds;
+};
+
+struct change_name {
+	int type, idx;
+	char from[4], to[4];
+};
+
+struct change_xyz {
+	int type, frame, idx;
+	vec_t from, to;
+};
+
+struct change_bond {
+	int type, i, j, from, to;
+};
+
+/* followed by the old and the new bonds as index-index-type triples */
+struct change_bonds {
+	int type, nfrom, nto;
+};
+
+/*
+ * Followed by n pairs of an atom added to or removed from the selection
+ * and the atom it followed in the order of selection, -1 if none.  Removed
+ * atoms are stored as -1 - index and go back to their place on undo.
+ */
+struct change_sel {
+	int type, is_visible, n;
 };
 
 static const vec_t h_table[] = {
@@ -44,8 +104,54 @@ static const vec_t h_table[] = {
 	{ -0.447,  1.263,  0.000 }, /* 16 S      H-2 */
 };
 
+/* covalent radii indexed by atom type, Cordero et al., Dalton Trans. 2008 */
+static const double radius_table[] = {
+	0.80, 0.31, 0.28, 1.28, 0.96, 0.84, 0.76, 0.71, 0.66, 0.57, /*   X-F  */
+	0.58, 1.66, 1.41, 1.21, 1.11, 1.07, 1.05, 1.02, 1.06, 2.03, /*  Ne-K  */
+	1.76, 1.70, 1.60, 1.53, 1.39, 1.39, 1.32, 1.26, 1.24, 1.32, /*  Ca-Cu */
+	1.22, 1.22, 1.20, 1.19, 1.20, 1.20, 1.16, 2.20, 1.95, 1.90, /*  Zn-Y  */
+	1.75, 1.64, 1.54, 1.47, 1.46, 1.42, 1.39, 1.45, 1.44, 1.42, /*  Zr-In */
+	1.39, 1.39, 1.38, 1.39, 1.40, 2.44, 2.15, 2.07, 2.04, 2.03, /*  Sn-Pr */
+	2.01, 1.99, 1.98, 1.98, 1.96, 1.94, 1.92, 1.92, 1.89, 1.90, /*  Nd-Tm */
+	1.87, 1.87, 1.75, 1.70, 1.62, 1.51, 1.44, 1.41, 1.36, 1.36, /*  Yb-Au */
+	1.32, 1.45, 1.46, 1.48, 1.40, 1.50, 1.50, 2.60, 2.21, 2.15, /*  Hg-Ac */
+	2.06, 2.00, 1.96, 1.90, 1.87, 1.80, 1.69, 1.50, 1.50, 1.50, /*  Th-Es */
+	1.50, 1.50, 1.50, 1.50                                      /*  Fm-Lr */
+};
+static const int nradius_table = sizeof radius_table / sizeof *radius_table;
+
+struct bondtable {
+	int ntypes;
+	int *type;          /* atom types */
+	double *cutoff2;    /* squared bond length limit for a pair of types */
+	double dist;        /* largest bond length limit */
+};
+
+static double
+get_radius(int type)
+{
+	return (type < nradius_table ? radius_table[type] : radius_table[0]);
+}
+
+static int
+is_bond(void *data, int i, int j, double d2)
+{
+	struct bondtable *table = data;
+
+	return (d2 < table->cutoff2[table->type[i] * table->ntypes +
+	    table->type[j]]);
+}
+
+/* hydrogens to be added, collected so that they are added at once */
+struct hydrogens {
+	int n, nalloc;
+	vec_t *xyz;
+	int *parent;        /* atom each hydrogen is bonded to */
+};
+
 static void
-add_hydrogens(struct sys *sys, int i, int j, int k, int offset, int count)
+add_hydrogens(struct sys *sys, struct hydrogens *h, int i, int j, int k,
+    int offset, int count)
 {
 	mat_t rotmat;
 	vec_t pi, pj, pk;
@@ -71,10 +177,15 @@ add_hydrogens(struct sys *sys, int i, int j, int k, int offset, int count)
 		pk = mat_vec(&rotmat, &pk);
 		pk = vec_add(&pk, &pi);
 
-		sys_add_atom(sys, "H", pk);
-
-		j = sys_get_atom_count(sys) - 1;
-		graph_edge_create(sys->graph, i, j, 1);
+		if (h->n == h->nalloc) {
+			h->nalloc = h->nalloc ? 2 * h->nalloc : 64;
+			h->xyz = xrealloc(h->xyz, h->nalloc * sizeof *h->xyz);
+			h->parent = xrealloc(h->parent,
+			    h->nalloc * sizeof *h->parent);
+		}
+		h->xyz[h->n] = pk;
+		h->parent[h->n] = i;
+		h->n++;
 	}
 }
 
@@ -92,6 +203,609 @@ get_bond_count(struct graph *graph, int idx)
 	return (count);
 }
 
+static void
+reset_spi(struct sys *sys)
+{
+	spi_free(sys->spi);
+	sys->spi = NULL;
+}
+
+static void
+log_change(struct sys *sys, const void *rec, size_t size)
+{
+	if (sys->undo) {
+		undo_record(sys->undo, rec, size);
+		sys->lastsel = NULL;
+	}
+}
+
+static void
+log_bond(void *data, int i, int j, int from, int to)
+{
+	struct sys *sys = data;
+	struct change_bond c;
+
+	if (sys->undo == NULL)
+		return;
+
+	c.type = CHANGE_BOND;
+	c.i = i;
+	c.j = j;
+	c.from = from;
+	c.to = to;
+	log_change(sys, &c, sizeof c);
+}
+
+/* all bonds as index-index-type triples, each bond once */
+static int *
+get_bonds(struct sys *sys, int *nbonds)
+{
+	struct graphedge *edge;
+	int i, j, k, *bonds;
+
+	*nbonds = 0;
+	for (i = 0; i < sys_get_atom_count(sys); i++)
+		for (edge = graph_get_edges(sys->graph, i); edge;
+		    edge = graph_edge_next(edge))
+			if (i < graph_edge_j(edge))
+				(*nbonds)++;
+
+	bonds = xcalloc(3 * *nbonds + 1, sizeof *bonds);
+	for (i = 0, k = 0; i < sys_get_atom_count(sys); i++)
+		for (edge = graph_get_edges(sys->graph, i); edge;
+		    edge = graph_edge_next(edge))
+			if (i < (j = graph_edge_j(edge))) {
+				bonds[k++] = i;
+				bonds[k++] = j;
+				bonds[k++] = graph_edge_get_type(edge);
+			}
+	return (bonds);
+}
+
+/* log replacing the bonds in from with the current ones */
+static void
+log_bonds(struct sys *sys, const int *from, int nfrom)
+{
+	struct change_bonds c;
+	char *buf;
+	size_t size;
+	int *to;
+
+	to = get_bonds(sys, &c.nto);
+	c.type = CHANGE_BONDS;
+	c.nfrom = nfrom;
+	size = sizeof c + 3 * (c.nfrom + c.nto) * sizeof *to;
+	buf = xcalloc(1, size);
+	memcpy(buf, &c, sizeof c);
+	memcpy(buf + sizeof c, from, 3 * c.nfrom * sizeof *from);
+	memcpy(buf + sizeof c + 3 * c.nfrom * sizeof *from, to,
+	    3 * c.nto * sizeof *to);
+	log_change(sys, buf, size);
+	free(buf);
+	free(to);
+}
+
+/* log a change to a selection, consecutive changes share a record */
+static void
+log_sel(void *data, struct sel *sel, int idx, int prev)
+{
+	struct sys *sys = data;
+	struct change_sel c;
+	char *rec;
+	int pair[2];
+
+	if (sys->undo == NULL)
+		return;
+
+	pair[0] = sel_selected(sel, idx) ? -1 - idx : idx;
+	pair[1] = prev;
+
+	if (sys->lastsel == sel &&
+	    sys->laststep == undo_get_version(sys->undo) &&
+	    (rec = undo_resize_state(sys->undo, sizeof c +
+	    (sys->nlastsel + 1) * sizeof pair)) != NULL) {
+		memcpy(rec + sizeof c + sys->nlastsel * sizeof pair, pair,
+		    sizeof pair);
+		memcpy(&c, rec, sizeof c);
+		c.n = ++sys->nlastsel;
+		memcpy(rec, &c, sizeof c);
+		return;
+	}
+	memset(&c, 0, sizeof c);
+	c.type = CHANGE_SEL;
+	c.is_visible = sel == sys->visible;
+	c.n = 1;
+	rec = xcalloc(1, sizeof c + sizeof pair);
+	memcpy(rec, &c, sizeof c);
+	memcpy(rec + sizeof c, pair, sizeof pair);
+	undo_record_state(sys->undo, rec, sizeof c + sizeof pair);
+	free(rec);
+	sys->lastsel = sel;
+	sys->laststep = undo_get_version(sys->undo);
+	sys->nlastsel = 1;
+}
+
+static void
+apply_sel(struct sys *sys, const char *rec, int redo)
+{
+	struct change_sel c;
+	struct sel *sel;
+	const int *pair;
+	int k;
+
+	memcpy(&c, rec, sizeof c);
+	sel = c.is_visible ? sys->visible : sys->sel;
+
+	for (k = 0; k < c.n; k++) {
+		pair = (const int *)(rec + sizeof c) +
+		    2 * (redo ? k : c.n - k - 1);
+		if (pair[0] < 0 && !redo)
+			sel_insert(sel, -1 - pair[0], pair[1]);
+		else if (pair[0] < 0)
+			sel_remove(sel, -1 - pair[0]);
+		else if (redo)
+			sel_add(sel, pair[0]);
+		else
+			sel_remove(sel, pair[0]);
+	}
+}
+
+static void
+log_add(struct sys *sys, int n, const vec_t *xyz)
+{
+	struct change_atoms c;
+	char *buf, (*names)[4];
+	size_t size;
+	int i, first;
+
+	if (sys->undo == NULL)
+		return;
+
+	size = sizeof c + n * (sizeof *xyz + sizeof *names);
+	buf = xcalloc(1, size);
+	names = (char (*)[4])(buf + sizeof c + n * sizeof *xyz);
+	first = sys_get_atom_count(sys) - n;
+
+	memset(&c, 0, sizeof c);
+	c.type = CHANGE_ADD;
+	c.n = n;
+	memcpy(buf, &c, sizeof c);
+	memcpy(buf + sizeof c, xyz, n * sizeof *xyz);
+	for (i = 0; i < n; i++)
+		strncpy(names[i], sys_get_atom_name(sys, first + i), 3);
+	log_change(sys, buf, size);
+	free(buf);
+}
+
+static void
+log_remove(struct sys *sys, const int *map)
+{
+	struct change_atoms c;
+	struct graphedge *edge;
+	vec_t *xyz;
+	char *buf, (*names)[4];
+	size_t size;
+	int i, j, k, n, frame, *idx, *bonds;
+
+	if (sys->undo == NULL)
+		return;
+
+	/* logged so that undo puts them back in their place in the order */
+	for (i = 0; i < sys_get_atom_count(sys); i++)
+		if (map[i] == -1)
+			sel_remove(sys->sel, i);
+	for (i = 0; i < sys_get_atom_count(sys); i++)
+		if (map[i] == -1)
+			sel_remove(sys->visible, i);
+
+	memset(&c, 0, sizeof c);
+	c.type = CHANGE_REMOVE;
+	c.nframes = sys_get_frame_count(sys);
+
+	for (i = 0; i < sys_get_atom_count(sys); i++) {
+		if (map[i] != -1)
+			continue;
+		c.n++;
+		for (edge = graph_get_edges(sys->graph, i); edge;
+		    edge = graph_edge_next(edge))
+			if (map[graph_edge_j(edge)] != -1 ||
+			    i < graph_edge_j(edge))
+				c.nbonds++;
+	}
+	size = sizeof c + c.n * c.nframes * sizeof *xyz +
+	    c.n * sizeof *idx + 3 * c.nbonds * sizeof *bonds +
+	    c.n * sizeof *names;
+	buf = xcalloc(1, size);
+	memcpy(buf, &c, sizeof c);
+	xyz = (vec_t *)(buf + sizeof c);
+	idx = (int *)(xyz + c.n * c.nframes);
+	bonds = idx + c.n;
+	names = (char (*)[4])(bonds + 3 * c.nbonds);
+	frame = sys_get_frame(sys);
+
+	for (i = 0, n = 0, k = 0; i < sys_get_atom_count(sys); i++) {
+		if (map[i] != -1)
+			continue;
+		for (j = 0; j < c.nframes; j++) {
+			atoms_set_frame(sys->atoms, j);
+			xyz[j * c.n + n] = atoms_get_xyz(sys->atoms, i);
+		}
+		for (edge = graph_get_edges(sys->graph, i); edge;
+		    edge = graph_edge_next(edge)) {
+			j = graph_edge_j(edge);
+			if (map[j] != -1 || i < j) {
+				bonds[k++] = i;
+				bonds[k++] = j;
+				bonds[k++] = graph_edge_get_type(edge);
+			}
+		}
+		idx[n] = i;
+		strncpy(names[n], sys_get_atom_name(sys, i), 3);
+		n++;
+	}
+	atoms_set_frame(sys->atoms, frame);
+	log_change(sys, buf, size);
+	free(buf);
+}
+
+static void
+reset_nblist(struct sys *sys)
+{
+	pairs_free(sys->nblist);
+	sys->nblist = NULL;
+	free(sys->nbxyz);
+	sys->nbxyz = NULL;
+}
+
+/* remove atoms, the map gives the new index of each atom or -1 */
+static void
+remove_atoms(struct sys *sys, const int *map)
+{
+	struct undo *undo;
+
+	log_remove(sys, map);
+	undo = sys->undo;
+	sys->undo = NULL;
+	atoms_remove_many(sys->atoms, map);
+	graph_vertex_remove_many(sys->graph, map);
+	sel_contract_many(sys->sel, map);
+	sel_contract_many(sys->visible, map);
+	if (sys->spi)
+		spi_remove_many(sys->spi, map);
+	reset_nblist(sys);
+	sys->undo = undo;
+	sys->is_modified = 1;
+}
+
+/* put back atoms removed by a logged removal */
+static void
+restore_atoms(struct sys *sys, const char *rec)
+{
+	struct change_atoms c;
+	const vec_t *xyz;
+	const int *idx, *bonds;
+	const char (*names)[4];
+	int i, j, k, n, frame, *map;
+
+	memcpy(&c, rec, sizeof c);
+	xyz = (const vec_t *)(rec + sizeof c);
+	idx = (const int *)(xyz + c.n * c.nframes);
+	bonds = idx + c.n;
+	names = (const char (*)[4])(bonds + 3 * c.nbonds);
+
+	n = sys_get_atom_count(sys) + c.n;
+	map = xcalloc(sys_get_atom_count(sys), sizeof *map);
+	for (i = 0, j = 0, k = 0; i < n; i++) {
+		if (k < c.n && idx[k] == i)
+			k++;
+		else
+			map[j++] = i;
+	}
+	atoms_insert_many(sys->atoms, n, map);
+	graph_vertex_insert_many(sys->graph, n, map);
+	sel_expand_many(sys->sel, n, map);
+	sel_expand_many(sys->visible, n, map);
+	free(map);
+
+	frame = sys_get_frame(sys);
+	for (j = 0; j < c.nframes && j < sys_get_frame_count(sys); j++) {
+		atoms_set_frame(sys->atoms, j);
+		for (k = 0; k < c.n; k++)
+			atoms_set_xyz(sys->atoms, idx[k], xyz[j * c.n + k]);
+	}
+	atoms_set_frame(sys->atoms, frame);
+
+	for (k = 0; k < c.n; k++)
+		atoms_set_name(sys->atoms, idx[k], names[k]);
+	for (k = 0; k < c.nbonds; k++)
+		graph_edge_create(sys->graph, bonds[3 * k],
+		    bonds[3 * k + 1], bonds[3 * k + 2]);
+	reset_spi(sys);
+	reset_nblist(sys);
+}
+
+static void
+set_frame_xyz(struct sys *sys, int frame, int idx, vec_t xyz)
+{
+	int oldframe;
+
+	if (frame == sys_get_frame(sys)) {
+		sys_set_atom_xyz(sys, idx, xyz);
+		return;
+	}
+	if (frame >= sys_get_frame_count(sys))
+		return;
+
+	oldframe = sys_get_frame(sys);
+	atoms_set_frame(sys->atoms, frame);
+	atoms_set_xyz(sys->atoms, idx, xyz);
+	atoms_set_frame(sys->atoms, oldframe);
+}
+
+static void
+set_bond(struct sys *sys, int i, int j, int type)
+{
+	if (type == 0)
+		graph_edge_remove(sys->graph, i, j);
+	else
+		graph_edge_create(sys->graph, i, j, type);
+}
+
+/* replace all bonds with the old or the new ones of a logged change */
+static void
+set_bonds(struct sys *sys, const char *rec, int redo)
+{
+	struct change_bonds c;
+	const int *bonds;
+	int i, n;
+
+	memcpy(&c, rec, sizeof c);
+	bonds = (const int *)(rec + sizeof c);
+	n = c.nfrom;
+	if (redo) {
+		bonds += 3 * c.nfrom;
+		n = c.nto;
+	}
+	for (i = 0; i < sys_get_atom_count(sys); i++)
+		graph_remove_vertex_edges(sys->graph, i);
+	for (i = 0; i < n; i++)
+		graph_edge_create(sys->graph, bonds[3 * i],
+		    bonds[3 * i + 1], bonds[3 * i + 2]);
+}
+
+static void
+apply_atoms(struct sys *sys, const char *rec, int redo)
+{
+	struct change_atoms c;
+	const vec_t *xyz;
+	const char (*names)[4];
+	const char **ptrs;
+	const int *idx;
+	int i, k, n, *map;
+
+	memcpy(&c, rec, sizeof c);
+	n = sys_get_atom_count(sys);
+
+	if (c.type == CHANGE_ADD && redo) {
+		xyz = (const vec_t *)(rec + sizeof c);
+		names = (const char (*)[4])(xyz + c.n);
+		ptrs = xcalloc(c.n, sizeof *ptrs);
+		for (i = 0; i < c.n; i++)
+			ptrs[i] = names[i];
+		sys_add_atoms(sys, c.n, ptrs, xyz);
+		free(ptrs);
+	} else if (c.type == CHANGE_REMOVE && !redo) {
+		restore_atoms(sys, rec);
+	} else {
+		map = xcalloc(n, sizeof *map);
+		if (c.type == CHANGE_ADD) {
+			for (i = 0; i < n; i++)
+				map[i] = i < n - c.n ? i : -1;
+		} else {
+			xyz = (const vec_t *)(rec + sizeof c);
+			idx = (const int *)(xyz + c.n * c.nframes);
+			for (i = 0; i < c.n; i++)
+				map[idx[i]] = -1;
+			for (i = 0, k = 0; i < n; i++)
+				if (map[i] != -1)
+					map[i] = k++;
+		}
+		remove_atoms(sys, map);
+		free(map);
+	}
+}
+
+/*
+ * Atoms are bonded if they are closer than the sum of their covalent radii
+ * plus the bond-tolerance setting.
+ */
+static void
+init_bond_table(struct sys *sys, struct bondtable *table)
+{
+	double tol, d, rmax;
+	int i, j, n;
+
+	n = sys_get_atom_count(sys);
+	tol = settings_get_double("bond-tolerance");
+	table->type = xcalloc(n, sizeof *table->type);
+	table->ntypes = 0;
+	rmax = 0.0;
+
+	for (i = 0; i < n; i++) {
+		table->type[i] = sys_get_atom_type(sys, i);
+		if (table->type[i] >= table->ntypes)
+			table->ntypes = table->type[i] + 1;
+		if (get_radius(table->type[i]) > rmax)
+			rmax = get_radius(table->type[i]);
+	}
+	table->cutoff2 = xcalloc(table->ntypes * table->ntypes,
+	    sizeof *table->cutoff2);
+
+	for (i = 0; i < table->ntypes; i++)
+		for (j = 0; j < table->ntypes; j++) {
+			d = get_radius(i) + get_radius(j) + tol;
+			table->cutoff2[i * table->ntypes + j] =
+			    d > 0.0 ? d * d : 0;
+		}
+	table->dist = 2.0 * rmax + tol;
+}
+
+static void
+free_bond_table(struct bondtable *table)
+{
+	free(table->type);
+	free(table->cutoff2);
+}
+
+static void
+set_bond_orders(struct sys *sys)
+{
+	int i;
+
+	for (i = 0; i < sys_get_atom_count(sys); i++) {
+		/* Double bond for Oxygen */
+		if (sys_get_atom_type(sys, i) == 8 &&
+		    graph_get_edge_count(sys->graph, i) == 1)
+			graph_edge_set_type(sys->graph,
+			    graph_get_edges(sys->graph, i), 2);
+	}
+}
+
+/* the candidate list holds while no atom has moved by half the skin */
+static int
+check_nblist(struct sys *sys, double dist, double skin)
+{
+	vec_t abc[3], xyz;
+	double limit;
+	int i;
+
+	if (sys->nblist == NULL || sys->nbdist != dist ||
+	    sys->nbskin != skin)
+		return (0);
+	if (sys_get_cell(sys, abc) != sys->nbperiodic ||
+	    (sys->nbperiodic && memcmp(abc, sys->nbcell, sizeof abc) != 0))
+		return (0);
+	if (sys_get_xyz_version(sys) == sys->nbversion)
+		return (1);
+
+	limit = skin * skin / 4.0;
+
+	for (i = 0; i < sys_get_atom_count(sys); i++) {
+		xyz = sys_get_atom_xyz(sys, i);
+		if (vec_distsq(&xyz, &sys->nbxyz[i]) > limit)
+			return (0);
+	}
+	return (1);
+}
+
+static void
+build_nblist(struct sys *sys, double dist, double skin)
+{
+	struct pair pair;
+	struct spi *spi;
+	int i, n;
+
+	reset_nblist(sys);
+	spi = sys_get_spi(sys);
+	spi_compute(spi, dist + skin);
+	sys->nblist = pairs_create();
+
+	for (i = 0; i < spi_get_pair_count(spi); i++) {
+		pair = spi_get_pair(spi, i);
+		pairs_add(sys->nblist, pair.i, pair.j);
+	}
+
+	n = sys_get_atom_count(sys);
+	sys->nbxyz = xcalloc(n, sizeof *sys->nbxyz);
+	for (i = 0; i < n; i++)
+		sys->nbxyz[i] = sys_get_atom_xyz(sys, i);
+
+	sys->nbperiodic = sys_get_cell(sys, sys->nbcell);
+	sys->nbversion = sys_get_xyz_version(sys);
+	sys->nbdist = dist;
+	sys->nbskin = skin;
+}
+
+/*
+ * Bonds for a new frame of a trajectory.  Candidate pairs are found within
+ * the bond distance plus a skin and reused for the following frames.
+ */
+static void
+update_frame_bonds(struct sys *sys)
+{
+	struct bondtable table;
+	struct pair pair;
+	vec_t xyz1, xyz2;
+	double skin;
+	int i, k, n;
+
+	n = sys_get_atom_count(sys);
+
+	for (i = 0; i < n; i++)
+		graph_remove_vertex_edges(sys->graph, i);
+
+	if (n == 0)
+		return;
+
+	init_bond_table(sys, &table);
+	skin = settings_get_double("bond-skin");
+	if (skin < 0.0)
+		skin = 0.0;
+	if (!check_nblist(sys, table.dist, skin))
+		build_nblist(sys, table.dist, skin);
+
+	for (k = 0; k < pairs_get_count(sys->nblist); k++) {
+		pair = pairs_get(sys->nblist, k);
+		xyz1 = sys_get_atom_xyz(sys, pair.i);
+		if (sys->nbperiodic)
+			xyz2 = sys_get_atom_image(sys, pair.j, xyz1);
+		else
+			xyz2 = sys_get_atom_xyz(sys, pair.j);
+		if (is_bond(&table, pair.i, pair.j, vec_distsq(&xyz1, &xyz2)) &&
+		    graph_edge_find(sys->graph, pair.i, pair.j) == NULL)
+			graph_edge_create(sys->graph, pair.i, pair.j, 1);
+	}
+	free_bond_table(&table);
+	set_bond_orders(sys);
+}
+
+/*
+ * The pair search runs once at the largest bond length and the table
+ * filters the pairs as they are found.
+ */
+static void
+reset_bonds(struct sys *sys)
+{
+	struct bondtable table;
+	struct pair pair;
+	struct spi *spi;
+	int i, j, k, n, np;
+
+	n = sys_get_atom_count(sys);
+	spi = sys_get_spi(sys);
+
+	for (i = 0; i < n; i++)
+		graph_remove_vertex_edges(sys->graph, i);
+
+	if (n == 0)
+		return;
+
+	init_bond_table(sys, &table);
+	spi_compute_filter(spi, table.dist, is_bond, &table);
+	np = spi_get_pair_count(spi);
+
+	for (k = 0; k < np; k++) {
+		pair = spi_get_pair(spi, k);
+		i = pair.i;
+		j = pair.j;
+
+		if (graph_edge_find(sys->graph, i, j) == NULL)
+			graph_edge_create(sys->graph, i, j, 1);
+	}
+	free_bond_table(&table);
+	set_bond_orders(sys);
+}
+
 struct sys *
 sys_create(const char *path)
 {
@@ -100,8 +814,11 @@ sys_create(const char *path)
 
 	sys = xcalloc(1, sizeof *sys);
 	sys->graph = graph_create();
+	graph_set_hook(sys->graph, log_bond, sys);
 	sys->sel = sel_create(0);
+	sel_set_hook(sys->sel, log_sel, sys);
 	sys->visible = sel_create(0);
+	sel_set_hook(sys->visible, log_sel, sys);
 
 	if (path == NULL || !util_file_exists(path)) {
 		sys->atoms = atoms_create();
@@ -121,21 +838,6 @@ sys_create(const char *path)
 	return (sys);
 }
 
-struct sys *
-sys_copy(struct sys *sys)
-{
-	struct sys *copy;
-
-	copy = xcalloc(1, sizeof *sys);
-	copy->is_modified = sys->is_modified;
-	copy->atoms = atoms_copy(sys->atoms);
-	copy->graph = graph_copy(sys->graph);
-	copy->sel = sel_copy(sys->sel);
-	copy->visible = sel_copy(sys->visible);
-
-	return (copy);
-}
-
 void
 sys_free(struct sys *sys)
 {
@@ -144,6 +846,8 @@ sys_free(struct sys *sys)
 		graph_free(sys->graph);
 		sel_free(sys->sel);
 		sel_free(sys->visible);
+		spi_free(sys->spi);
+		reset_nblist(sys);
 		free(sys);
 	}
 }
@@ -166,12 +870,116 @@ sys_get_visible(struct sys *sys)
 	return (sys->visible);
 }
 
+struct spi *
+sys_get_spi(struct sys *sys)
+{
+	vec_t abc[3];
+	int i;
+
+	if (sys->spi == NULL) {
+		sys->spi = spi_create();
+		if (sys_get_cell(sys, abc))
+			spi_set_lattice(sys->spi, abc);
+		for (i = 0; i < sys_get_atom_count(sys); i++)
+			spi_add_point(sys->spi, sys_get_atom_xyz(sys, i));
+	}
+	return (sys->spi);
+}
+
+/* log changes to undo from now on, NULL to stop logging */
+void
+sys_set_undo(struct sys *sys, struct undo *undo)
+{
+	sys->undo = undo;
+}
+
+/* revert a change from the undo log, or make it again if redo is set */
+void
+sys_apply_change(struct sys *sys, void *rec, size_t size, int redo)
+{
+	struct change_name name;
+	struct change_xyz xyz;
+	struct change_bond bond;
+	struct undo *undo;
+	int type;
+
+	assert(size >= sizeof type);
+	memcpy(&type, rec, sizeof type);
+	undo = sys->undo;
+	sys->undo = NULL;
+
+	switch (type) {
+	case CHANGE_ADD:
+	case CHANGE_REMOVE:
+		apply_atoms(sys, rec, redo);
+		break;
+	case CHANGE_NAME:
+		memcpy(&name, rec, sizeof name);
+		atoms_set_name(sys->atoms, name.idx, redo ? name.to : name.from);
+		break;
+	case CHANGE_XYZ:
+		memcpy(&xyz, rec, sizeof xyz);
+		set_frame_xyz(sys, xyz.frame, xyz.idx, redo ? xyz.to : xyz.from);
+		break;
+	case CHANGE_BOND:
+		memcpy(&bond, rec, sizeof bond);
+		set_bond(sys, bond.i, bond.j, redo ? bond.to : bond.from);
+		break;
+	case CHANGE_BONDS:
+		set_bonds(sys, rec, redo);
+		break;
+	case CHANGE_SEL:
+		apply_sel(sys, rec, redo);
+		break;
+	}
+	sys->undo = undo;
+}
+
 int
 sys_is_modified(struct sys *sys)
 {
 	return (sys->is_modified);
 }
 
+void
+sys_set_modified(struct sys *sys, int is_modified)
+{
+	sys->is_modified = is_modified;
+}
+
+/*
+ * Versions change whenever the data they cover does.  As all versions come
+ * from one counter, the larger of two is a valid version of both.
+ */
+version_t
+sys_get_topology_version(struct sys *sys)
+{
+	version_t a, g;
+
+	a = atoms_get_version(sys->atoms);
+	g = graph_get_version(sys->graph);
+
+	return (a > g ? a : g);
+}
+
+version_t
+sys_get_xyz_version(struct sys *sys)
+{
+	return (atoms_get_xyz_version(sys->atoms));
+}
+
+version_t
+sys_get_sel_version(struct sys *sys)
+{
+	return (sel_get_version(sys->sel));
+}
+
+version_t
+sys_get_visible_version(struct sys *sys)
+{
+	return (sel_get_version(sys->visible));
+}
+
 int
 sys_get_frame(struct sys *sys)
 {
@@ -181,7 +989,23 @@ sys_get_frame(struct sys *sys)
 void
 sys_set_frame(struct sys *sys, int frame)
 {
+	struct undo *undo;
+	int oldframe;
+
+	oldframe = sys_get_frame(sys);
 	atoms_set_frame(sys->atoms, frame);
+
+	if (sys_get_frame(sys) != oldframe) {
+		reset_spi(sys);
+		if (settings_get_bool("bond-per-frame")) {
+			/* these bonds follow from the frame, keep them out
+			 * of the undo log */
+			undo = sys->undo;
+			sys->undo = NULL;
+			update_frame_bonds(sys);
+			sys->undo = undo;
+		}
+	}
 }
 
 int
@@ -193,24 +1017,84 @@ sys_get_frame_count(struct sys *sys)
 void
 sys_add_atom(struct sys *sys, const char *name, vec_t xyz)
 {
-	atoms_add(sys->atoms, name, xyz);
-	graph_vertex_add(sys->graph);
-	sel_expand(sys->sel);
-	sel_expand(sys->visible);
-	sel_add(sys->visible, sel_get_size(sys->visible)-1);
+	sys_add_atoms(sys, 1, &name, &xyz);
+}
+
+void
+sys_add_atoms(struct sys *sys, int n, const char **names, const vec_t *xyz)
+{
+	struct undo *undo;
+	int i;
+
+	if (n < 1)
+		return;
+
+	atoms_add_many(sys->atoms, n, names, xyz);
+	log_add(sys, n, xyz);
+	/* new atoms are made visible as part of the logged addition */
+	undo = sys->undo;
+	sys->undo = NULL;
+	for (i = 0; i < n; i++) {
+		graph_vertex_add(sys->graph);
+		sel_expand(sys->sel);
+		sel_expand(sys->visible);
+		sel_add(sys->visible, sel_get_size(sys->visible)-1);
+		if (sys->spi)
+			spi_add_point(sys->spi, xyz[i]);
+	}
+	sys->undo = undo;
+	reset_nblist(sys);
 	sys->is_modified = 1;
 }
 
 void
 sys_remove_atom(struct sys *sys, int idx)
 {
+	struct undo *undo;
+	int i, *map;
+
+	if (sys->undo) {
+		map = xcalloc(sys_get_atom_count(sys), sizeof *map);
+		for (i = 0; i < sys_get_atom_count(sys); i++)
+			map[i] = i < idx ? i : i == idx ? -1 : i - 1;
+		log_remove(sys, map);
+		free(map);
+	}
+	undo = sys->undo;
+	sys->undo = NULL;
 	atoms_remove(sys->atoms, idx);
 	graph_vertex_remove(sys->graph, idx);
 	sel_contract(sys->sel, idx);
 	sel_contract(sys->visible, idx);
+	if (sys->spi)
+		spi_remove_point(sys->spi, idx);
+	reset_nblist(sys);
+	sys->undo = undo;
 	sys->is_modified = 1;
 }
 
+/* remove selected atoms with one pass over atoms, bonds and selections */
+void
+sys_remove_atoms(struct sys *sys, struct sel *sel)
+{
+	int i, n, *map;
+
+	map = xcalloc(sys_get_atom_count(sys), sizeof *map);
+
+	for (i = 0, n = 0; i < sys_get_atom_count(sys); i++)
+		map[i] = sel_selected(sel, i) ? -1 : n++;
+
+	if (n < sys_get_atom_count(sys))
+		remove_atoms(sys, map);
+	free(map);
+}
+
+int
+sys_get_cell(struct sys *sys, vec_t *abc)
+{
+	return (atoms_get_cell(sys->atoms, abc));
+}
+
 int
 sys_get_atom_count(struct sys *sys)
 {
@@ -232,7 +1116,16 @@ sys_get_atom_type(struct sys *sys, int idx)
 void
 sys_set_atom_name(struct sys *sys, int idx, const char *name)
 {
+	struct change_name c;
+
+	memset(&c, 0, sizeof c);
+	c.type = CHANGE_NAME;
+	c.idx = idx;
+	strncpy(c.from, sys_get_atom_name(sys, idx), 3);
 	atoms_set_name(sys->atoms, idx, name);
+	strncpy(c.to, sys_get_atom_name(sys, idx), 3);
+	if (strcmp(c.from, c.to) != 0)
+		log_change(sys, &c, sizeof c);
 	sys->is_modified = 1;
 }
 
@@ -242,17 +1135,58 @@ sys_get_atom_xyz(struct sys *sys, int idx)
 	return (atoms_get_xyz(sys->atoms, idx));
 }
 
+/* position of the periodic image of an atom that is closest to ref */
+vec_t
+sys_get_atom_image(struct sys *sys, int idx, vec_t ref)
+{
+	vec_t abc[3], bc, d, t, xyz;
+	double f;
+	int i;
+
+	xyz = sys_get_atom_xyz(sys, idx);
+
+	if (!sys_get_cell(sys, abc))
+		return (xyz);
+
+	d = vec_sub(&xyz, &ref);
+	for (i = 0; i < 3; i++) {
+		bc = vec_cross(&abc[(i + 1) % 3], &abc[(i + 2) % 3]);
+		f = vec_dot(&bc, &d) / vec_dot(&bc, &abc[i]);
+		t = abc[i];
+		vec_scale(&t, -floor(f + 0.5));
+		xyz = vec_add(&xyz, &t);
+	}
+	return (xyz);
+}
+
 void
 sys_set_atom_xyz(struct sys *sys, int idx, vec_t xyz)
 {
+	struct change_xyz c;
+
+	if (sys->undo) {
+		memset(&c, 0, sizeof c);
+		c.type = CHANGE_XYZ;
+		c.frame = sys_get_frame(sys);
+		c.idx = idx;
+		c.from = sys_get_atom_xyz(sys, idx);
+		c.to = xyz;
+		log_change(sys, &c, sizeof c);
+	}
 	atoms_set_xyz(sys->atoms, idx, xyz);
+	if (sys->spi)
+		spi_set_point(sys->spi, idx, xyz);
 	sys->is_modified = 1;
 }
 
 void
 sys_add_hydrogens(struct sys *sys, struct sel *sel)
 {
-	int i, j, k, l, n_bond, n_neig;
+	struct hydrogens h;
+	const char **names;
+	int i, j, k, l, n, n_bond, n_neig;
+
+	memset(&h, 0, sizeof h);
 
 	sel_iter_start(sel);
 	while (sel_iter_next(sel, &i)) {
@@ -263,11 +1197,11 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 
 			if (n_bond == 0) {
 				/* add 4 sp3 */
-				add_hydrogens(sys, i, j, k, 0, 4);
+				add_hydrogens(sys, &h, i, j, k, 0, 4);
 			} else if (n_bond == 1) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				/* add 3 sp3 */
-				add_hydrogens(sys, i, j, k, 1, 3);
+				add_hydrogens(sys, &h, i, j, k, 1, 3);
 			} else if (n_bond == 2) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				if (n_neig == 1) {
@@ -277,32 +1211,33 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 							k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, j)));
 					}
 					/* add 2 sp2 */
-					add_hydrogens(sys, i, j, k, 4, 2);
+					add_hydrogens(sys, &h, i, j, k, 4, 2);
 				} else if (n_neig == 2) {
 					k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, i)));
 					/* add 2 sp3 */
-					add_hydrogens(sys, i, j, k, 2, 2);
+					add_hydrogens(sys, &h, i, j, k, 2, 2);
 				}
 			} else if (n_bond == 3) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				if (n_neig == 1) {
 					/* add 1 sp */
-					add_hydrogens(sys, i, j, k, 6, 1);
+					add_hydrogens(sys, &h, i, j, k, 6, 1);
 				} else if (n_neig == 2) {
 					k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, i)));
 					/* add 1 sp2 */
-					add_hydrogens(sys, i, j, k, 5, 1);
+					add_hydrogens(sys, &h, i, j, k, 5, 1);
 				} else if (n_neig == 3) {
 					vec_t pl, ph1, ph2;
 					k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, i)));
 					l = graph_edge_j(graph_edge_next(graph_edge_next(graph_get_edges(sys->graph, i))));
 					/* add 2 sp3 and remove the wrong one */
-					add_hydrogens(sys, i, j, k, 2, 2);
+					add_hydrogens(sys, &h, i, j, k, 2, 2);
 					pl = sys_get_atom_xyz(sys, l);
-					ph1 = sys_get_atom_xyz(sys, sys_get_atom_count(sys) - 2);
-					ph2 = sys_get_atom_xyz(sys, sys_get_atom_count(sys) - 1);
-					k = vec_dist(&pl, &ph1) < vec_dist(&pl, &ph2) ? 2 : 1;
-					sys_remove_atom(sys, sys_get_atom_count(sys) - k);
+					ph1 = h.xyz[h.n - 2];
+					ph2 = h.xyz[h.n - 1];
+					if (vec_dist(&pl, &ph1) < vec_dist(&pl, &ph2))
+						h.xyz[h.n - 2] = ph2;
+					h.n--;
 				}
 			}
 		} else if (sys_get_atom_type(sys, i) == 7) { /* N */
@@ -312,11 +1247,11 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 
 			if (n_bond == 0) {
 				/* add 3 */
-				add_hydrogens(sys, i, j, k, 7, 3);
+				add_hydrogens(sys, &h, i, j, k, 7, 3);
 			} else if (n_bond == 1) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				/* add 2 */
-				add_hydrogens(sys, i, j, k, 8, 2);
+				add_hydrogens(sys, &h, i, j, k, 8, 2);
 			} else if (n_bond == 2) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 
@@ -324,7 +1259,7 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 					k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, i)));
 
 				/* add 1 */
-				add_hydrogens(sys, i, j, k, 9, 1);
+				add_hydrogens(sys, &h, i, j, k, 9, 1);
 			}
 		} else if (sys_get_atom_type(sys, i) == 8) { /* O */
 			n_bond = get_bond_count(sys->graph, i);
@@ -332,11 +1267,11 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 
 			if (n_bond == 0) {
 				/* add 2 */
-				add_hydrogens(sys, i, j, k, 13, 2);
+				add_hydrogens(sys, &h, i, j, k, 13, 2);
 			} else if (n_bond == 1) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				/* add 1 */
-				add_hydrogens(sys, i, j, k, 14, 1);
+				add_hydrogens(sys, &h, i, j, k, 14, 1);
 			}
 		} else if (sys_get_atom_type(sys, i) == 15) { /* P */
 			n_neig = graph_get_edge_count(sys->graph, i);
@@ -345,11 +1280,11 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 
 			if (n_bond == 0) {
 				/* add 3 */
-				add_hydrogens(sys, i, j, k, 10, 3);
+				add_hydrogens(sys, &h, i, j, k, 10, 3);
 			} else if (n_bond == 1) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				/* add 2 */
-				add_hydrogens(sys, i, j, k, 11, 2);
+				add_hydrogens(sys, &h, i, j, k, 11, 2);
 			} else if (n_bond == 2) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 
@@ -357,7 +1292,7 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 					k = graph_edge_j(graph_edge_next(graph_get_edges(sys->graph, i)));
 
 				/* add 1 */
-				add_hydrogens(sys, i, j, k, 12, 1);
+				add_hydrogens(sys, &h, i, j, k, 12, 1);
 			}
 		} else if (sys_get_atom_type(sys, i) == 16) { /* S */
 			n_bond = get_bond_count(sys->graph, i);
@@ -365,14 +1300,26 @@ sys_add_hydrogens(struct sys *sys, struct sel *sel)
 
 			if (n_bond == 0) {
 				/* add 2 */
-				add_hydrogens(sys, i, j, k, 15, 2);
+				add_hydrogens(sys, &h, i, j, k, 15, 2);
 			} else if (n_bond == 1) {
 				j = graph_edge_j(graph_get_edges(sys->graph, i));
 				/* add 1 */
-				add_hydrogens(sys, i, j, k, 16, 1);
+				add_hydrogens(sys, &h, i, j, k, 16, 1);
 			}
 		}
 	}
+	if (h.n > 0) {
+		n = sys_get_atom_count(sys);
+		names = xcalloc(h.n, sizeof *names);
+		for (i = 0; i < h.n; i++)
+			names[i] = "H";
+		sys_add_atoms(sys, h.n, names, h.xyz);
+		for (i = 0; i < h.n; i++)
+			graph_edge_create(sys->graph, h.parent[i], n + i, 1);
+		free(names);
+	}
+	free(h.xyz);
+	free(h.parent);
 }
 
 vec_t
@@ -393,46 +1340,23 @@ sys_get_sel_center(struct sys *sys, struct sel *sel)
 	return (center);
 }
 
+/* replace all bonds at once, logged as a single change */
 void
 sys_reset_bonds(struct sys *sys)
 {
-	struct pair pair;
-	struct spi *spi;
-	int i, j, k, n, np;
-
-	n = sys_get_atom_count(sys);
-	spi = spi_create();
-
-	for (i = 0; i < n; i++) {
-		graph_remove_vertex_edges(sys->graph, i);
-		spi_add_point(spi, sys_get_atom_xyz(sys, i));
-	}
-
-	spi_compute(spi, 1.6);
-	np = spi_get_pair_count(spi);
-
-	for (k = 0; k < np; k++) {
-		pair = spi_get_pair(spi, k);
-		i = pair.i;
-		j = pair.j;
-
-		/* No bond between two Hydrogen atoms */
-		if (sys_get_atom_type(sys, i) == 1 &&
-		    sys_get_atom_type(sys, j) == 1)
-			continue;
+	struct undo *undo;
+	int *from, nfrom;
 
-		if (graph_edge_find(sys->graph, i, j) == NULL)
-			graph_edge_create(sys->graph, i, j, 1);
+	if ((undo = sys->undo) == NULL) {
+		reset_bonds(sys);
+		return;
 	}
-
-	for (i = 0; i < n; i++) {
-		/* Double bond for Oxygen */
-		if (sys_get_atom_type(sys, i) == 8 &&
-		    graph_get_edge_count(sys->graph, i) == 1)
-			graph_edge_set_type(graph_get_edges(sys->graph, i), 2);
-	}
-
-	spi_free(spi);
+	from = get_bonds(sys, &nfrom);
+	sys->undo = NULL;
+	reset_bonds(sys);
+	sys->undo = undo;
+	log_bonds(sys, from, nfrom);
+	free(from);
 }
 
 int
@@ -440,7 +1364,10 @@ sys_save_to_file(struct sys *sys, const char *path)
 {
 	int rc;
 
-	if ((rc = formats_save(sys->atoms, path)))
+	if ((rc = formats_save(sys->atoms, path))) {
 		sys->is_modified = 0;
+		if (sys->undo)
+			undo_set_saved(sys->undo);
+	}
 	return (rc);
 }
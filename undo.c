@@ -16,41 +16,260 @@
 
 #include "vimol.h"
 
-struct node {
-	void *data;
-	struct node *next;
-	struct node *prev;
+/*
+ * Undo history is a list of steps, each a log of changes made after a
+ * snapshot.  Changes are opaque records which are handed back to the
+ * apply function to be reverted or done again.  Every record is framed
+ * by its size on both sides so that a step can be walked either way.
+ *
+ * State records keep things that are not saved with the data, such as
+ * changes to a selection.  They do not make the data differ from the
+ * saved one and can be added without losing steps that can be redone.
+ * The last record of a step can grow if it is a state record, so that
+ * many small changes take one record.
+ *
+ * When steps take more memory than the undo-memory setting allows, the
+ * oldest ones are moved to a temporary file and read back when undone.
+ * Copies in the file that are no longer needed leave holes, and the file
+ * is rewritten when the holes take more than the copies still in use.
+ *
+ * The position at which the data was last saved is remembered, so that
+ * undo and redo can tell whether they got back to the saved state.
+ */
+
+struct step {
+	char *buf;          /* NULL if the step is only in the file */
+	size_t len, nalloc;
+	long offset;        /* copy in the file, -1 if none */
+	int has_changes;    /* has records other than state records */
+	int has_state;
 };
 
 struct undo {
-	void *(*copy)(void *);
-	void (*free)(void *);
-	struct node *iter;
+	void *data;
+	void (*apply)(void *, void *, size_t, int);
+	int nsteps, nalloc;
+	int pos;            /* steps before this one are applied */
+	struct step *steps;
+	size_t memory;      /* bytes held by steps in memory */
+	size_t limit;
+	int is_limited;
+	int is_truncate;
+	int first;          /* steps before this one are not in memory */
+	FILE *fp;
+	int nfile;          /* steps with a copy in the file */
+	size_t filelen;     /* bytes written to the file */
+	size_t fileused;    /* bytes of copies still in use */
+	int saved;          /* pos when last saved, -1 if no longer reachable */
+	version_t version;  /* changes whenever the current step does */
 };
 
 static void
-free_all(struct undo *undo, struct node *node)
+free_step(struct undo *undo, struct step *step)
+{
+	if (step->offset >= 0) {
+		undo->nfile--;
+		undo->fileused -= step->len;
+	}
+	undo->memory -= step->nalloc;
+	free(step->buf);
+}
+
+static void
+drop_steps(struct undo *undo, int from)
+{
+	int i;
+
+	for (i = from; i < undo->nsteps; i++)
+		free_step(undo, &undo->steps[i]);
+	undo->nsteps = from;
+	if (undo->first > from)
+		undo->first = from;
+	if (undo->saved > from)
+		undo->saved = -1;
+}
+
+/* forget the n oldest steps */
+static void
+drop_oldest(struct undo *undo, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		free_step(undo, &undo->steps[i]);
+	memmove(undo->steps, undo->steps + n,
+	    (undo->nsteps - n) * sizeof *undo->steps);
+	undo->nsteps -= n;
+	undo->pos -= n;
+	undo->first = undo->first > n ? undo->first - n : 0;
+	undo->saved = undo->saved >= n ? undo->saved - n : -1;
+	undo->version = util_next_version();
+}
+
+/* the copy of a step in the file no longer matches */
+static void
+forget_file_copy(struct undo *undo, struct step *step)
+{
+	if (step->offset >= 0) {
+		step->offset = -1;
+		undo->nfile--;
+		undo->fileused -= step->len;
+	}
+}
+
+/* move the copies still in use to a new file, return 0 on failure */
+static int
+compact_file(struct undo *undo)
+{
+	struct step *step;
+	FILE *fp;
+	long *offset;
+	char *buf;
+	int i, ok;
+
+	if ((fp = tmpfile()) == NULL)
+		return (0);
+
+	offset = xcalloc(undo->nsteps, sizeof *offset);
+	ok = 1;
+
+	for (i = 0; ok && i < undo->nsteps; i++) {
+		step = &undo->steps[i];
+		if (step->offset < 0)
+			continue;
+		buf = xcalloc(1, step->len + 1);
+		ok = fseek(undo->fp, step->offset, SEEK_SET) == 0 &&
+		    fread(buf, 1, step->len, undo->fp) == step->len &&
+		    (offset[i] = ftell(fp)) >= 0 &&
+		    fwrite(buf, 1, step->len, fp) == step->len;
+		free(buf);
+	}
+	if (ok) {
+		for (i = 0; i < undo->nsteps; i++)
+			if (undo->steps[i].offset >= 0)
+				undo->steps[i].offset = offset[i];
+		fclose(undo->fp);
+		undo->fp = fp;
+		undo->filelen = undo->fileused;
+	} else
+		fclose(fp);
+	free(offset);
+
+	return (ok);
+}
+
+/*
+ * Free the memory of a step, writing it to the file first unless the file
+ * already has a copy.  Return 0 if the step cannot be written.
+ */
+static int
+spill_step(struct undo *undo, struct step *step)
+{
+	if (step->offset < 0) {
+		if (undo->nfile == 0 && undo->fp) {
+			/* nothing in the file is needed any more */
+			fclose(undo->fp);
+			undo->fp = NULL;
+			undo->filelen = 0;
+		} else if (undo->fp &&
+		    undo->filelen - undo->fileused > undo->fileused)
+			compact_file(undo);
+		if (undo->fp == NULL && (undo->fp = tmpfile()) == NULL)
+			return (0);
+		if (fseek(undo->fp, 0, SEEK_END) != 0 ||
+		    (step->offset = ftell(undo->fp)) < 0 ||
+		    fwrite(step->buf, 1, step->len, undo->fp) != step->len) {
+			step->offset = -1;
+			return (0);
+		}
+		undo->nfile++;
+		undo->filelen = (size_t)step->offset + step->len;
+		undo->fileused += step->len;
+	}
+	undo->memory -= step->nalloc;
+	free(step->buf);
+	step->buf = NULL;
+	step->nalloc = 0;
+
+	return (1);
+}
+
+/* bring step i back from the file, return 0 if it cannot be read */
+static int
+load_step(struct undo *undo, int i)
+{
+	struct step *step;
+	char *buf;
+
+	step = &undo->steps[i];
+
+	if (step->buf || step->len == 0)
+		return (1);
+
+	buf = xcalloc(1, step->len);
+
+	if (fseek(undo->fp, step->offset, SEEK_SET) != 0 ||
+	    fread(buf, 1, step->len, undo->fp) != step->len) {
+		free(buf);
+		return (0);
+	}
+	step->buf = buf;
+	step->nalloc = step->len;
+	undo->memory += step->nalloc;
+	if (undo->first > i)
+		undo->first = i;
+
+	return (1);
+}
+
+static void
+read_settings(struct undo *undo)
+{
+	int size;
+
+	size = settings_get_int("undo-memory");
+	undo->is_limited = size >= 0;
+	undo->limit = undo->is_limited ? (size_t)size << 20 : 0;
+	undo->is_truncate = settings_get_bool("undo-truncate");
+}
+
+/*
+ * Keep memory within the undo-memory setting by moving steps older than
+ * keep to the file, or by forgetting them if undo-truncate is set or the
+ * file cannot be written.
+ */
+static void
+trim_memory(struct undo *undo, int keep)
 {
-	struct node *next;
+	struct step *step;
+	int n;
+
+	if (!undo->is_limited)
+		return;
 
-	while (node) {
-		next = node->next;
-		(undo->free)(node->data);
-		free(node);
-		node = next;
+	while (undo->first < keep && undo->memory > undo->limit) {
+		step = &undo->steps[undo->first];
+
+		if (step->buf && (undo->is_truncate ||
+		    !spill_step(undo, step))) {
+			n = undo->first + 1;
+			drop_oldest(undo, n);
+			keep -= n;
+		} else
+			undo->first++;
 	}
 }
 
 struct undo *
-undo_create(void *data, void *(*copy)(void *), void (*free)(void *))
+undo_create(void *data, void (*apply)(void *, void *, size_t, int))
 {
 	struct undo *undo;
 
 	undo = xcalloc(1, sizeof *undo);
-	undo->copy = copy;
-	undo->free = free;
-	undo->iter = xcalloc(1, sizeof *undo->iter);
-	undo->iter->data = data;
+	undo->data = data;
+	undo->apply = apply;
+	undo->version = util_next_version();
+	read_settings(undo);
 
 	return (undo);
 }
@@ -59,9 +278,10 @@ void
 undo_free(struct undo *undo)
 {
 	if (undo) {
-		while (undo->iter->prev)
-			undo->iter = undo->iter->prev;
-		free_all(undo, undo->iter);
+		drop_steps(undo, 0);
+		free(undo->steps);
+		if (undo->fp)
+			fclose(undo->fp);
 		free(undo);
 	}
 }
@@ -69,42 +289,224 @@ undo_free(struct undo *undo)
 void *
 undo_get_data(struct undo *undo)
 {
-	return (undo->iter->data);
+	return (undo->data);
+}
+
+/* bytes of undo history held in memory */
+size_t
+undo_get_memory(struct undo *undo)
+{
+	return (undo->memory);
+}
+
+/* remember that the data is saved in its current state */
+void
+undo_set_saved(struct undo *undo)
+{
+	undo->saved = undo->pos;
+}
+
+/* changes whenever a step is taken, undone or redone */
+version_t
+undo_get_version(struct undo *undo)
+{
+	return (undo->version);
+}
+
+/* check if steps between the current and the saved state change nothing */
+int
+undo_is_saved(struct undo *undo)
+{
+	int i, from, to;
+
+	if (undo->saved < 0)
+		return (0);
+
+	from = undo->pos < undo->saved ? undo->pos : undo->saved;
+	to = undo->pos < undo->saved ? undo->saved : undo->pos;
+
+	for (i = from; i < to; i++)
+		if (undo->steps[i].has_changes)
+			return (0);
+	return (1);
 }
 
 void
 undo_snapshot(struct undo *undo)
 {
-	struct node *node;
+	drop_steps(undo, undo->pos);
+	read_settings(undo);
+
+	if (undo->nsteps == undo->nalloc) {
+		undo->nalloc = undo->nalloc ? 2 * undo->nalloc : 16;
+		undo->steps = xrealloc(undo->steps,
+		    undo->nalloc * sizeof *undo->steps);
+	}
+	memset(&undo->steps[undo->nsteps], 0, sizeof *undo->steps);
+	undo->steps[undo->nsteps].offset = -1;
+	undo->nsteps++;
+	undo->pos = undo->nsteps;
+	undo->version = util_next_version();
+	trim_memory(undo, undo->pos - 1);
+}
+
+/*
+ * Make room for a record of the given size at the end of the current step
+ * and return it, or NULL if the step is lost.  Bytes already at that place
+ * are kept.
+ */
+static char *
+add_record(struct undo *undo, size_t size)
+{
+	struct step *step;
+	size_t need, pad;
+	char *rec;
+
+	step = &undo->steps[undo->pos - 1];
+	forget_file_copy(undo, step);
+	pad = (size + sizeof size - 1) / sizeof size * sizeof size;
+	need = step->len + pad + 2 * sizeof size;
+
+	if (need > step->nalloc) {
+		undo->memory -= step->nalloc;
+		step->nalloc = step->nalloc ? step->nalloc : 256;
+		while (step->nalloc < need)
+			step->nalloc *= 2;
+		step->buf = xrealloc(step->buf, step->nalloc);
+		undo->memory += step->nalloc;
+	}
+	rec = step->buf + step->len + sizeof size;
+	memcpy(rec - sizeof size, &size, sizeof size);
+	memcpy(rec + pad, &size, sizeof size);
+	step->len = need;
+
+	return (rec);
+}
+
+/* append a record to the current step, return 0 if the step is lost */
+static int
+append_record(struct undo *undo, const void *rec, size_t size)
+{
+	if (!load_step(undo, undo->pos - 1)) {
+		drop_oldest(undo, undo->pos);
+		return (0);
+	}
+	memcpy(add_record(undo, size), rec, size);
+
+	return (1);
+}
+
+/*
+ * Add a change to the current step.  Changes made before the first
+ * snapshot cannot be undone and are not kept.
+ */
+void
+undo_record(struct undo *undo, const void *rec, size_t size)
+{
+	drop_steps(undo, undo->pos);
 
-	free_all(undo, undo->iter->next);
+	if (undo->saved == undo->pos)
+		undo->saved = -1;
+	if (undo->pos == 0)
+		return;
 
-	node = xcalloc(1, sizeof *node);
-	node->data = (undo->copy)(undo->iter->data);
+	if (append_record(undo, rec, size)) {
+		undo->steps[undo->pos - 1].has_changes = 1;
+		trim_memory(undo, undo->pos - 1);
+	}
+}
+
+/* add a state record to the current step, see above */
+void
+undo_record_state(struct undo *undo, const void *rec, size_t size)
+{
+	if (undo->pos == 0)
+		return;
 
-	undo->iter->next = node;
-	node->prev = undo->iter;
-	undo->iter = node;
+	if (append_record(undo, rec, size)) {
+		undo->steps[undo->pos - 1].has_state = 1;
+		trim_memory(undo, undo->pos - 1);
+	}
+}
+
+/*
+ * Resize the last record of the current step, which must be a state
+ * record, and return it.  Return NULL if there is no such record.
+ */
+void *
+undo_resize_state(struct undo *undo, size_t size)
+{
+	struct step *step;
+	size_t last, pad;
+	char *rec;
+
+	if (undo->pos == 0)
+		return (NULL);
+
+	if (!load_step(undo, undo->pos - 1)) {
+		drop_oldest(undo, undo->pos);
+		return (NULL);
+	}
+	step = &undo->steps[undo->pos - 1];
+
+	if (!step->has_state || step->len == 0)
+		return (NULL);
+
+	forget_file_copy(undo, step);
+	memcpy(&last, step->buf + step->len - sizeof last, sizeof last);
+	pad = (last + sizeof last - 1) / sizeof last * sizeof last;
+	step->len -= pad + 2 * sizeof last;
+	rec = add_record(undo, size);
+	trim_memory(undo, undo->pos - 1);
+
+	return (rec);
 }
 
 int
 undo_undo(struct undo *undo)
 {
-	if (undo->iter->prev == NULL)
+	struct step *step;
+	size_t end, size, pad;
+
+	if (undo->pos == 0)
 		return (0);
 
-	undo->iter = undo->iter->prev;
+	if (!load_step(undo, undo->pos - 1)) {
+		/* older history is lost with this step */
+		drop_oldest(undo, undo->pos);
+		return (0);
+	}
+	step = &undo->steps[--undo->pos];
 
+	for (end = step->len; end > 0; end -= pad + 2 * sizeof size) {
+		memcpy(&size, step->buf + end - sizeof size, sizeof size);
+		pad = (size + sizeof size - 1) / sizeof size * sizeof size;
+		(undo->apply)(undo->data,
+		    step->buf + end - sizeof size - pad, size, 0);
+	}
+	undo->version = util_next_version();
+	trim_memory(undo, undo->pos);
 	return (1);
 }
 
 int
 undo_redo(struct undo *undo)
 {
-	if (undo->iter->next == NULL)
+	struct step *step;
+	size_t start, size, pad;
+
+	if (undo->pos == undo->nsteps)
 		return (0);
 
-	undo->iter = undo->iter->next;
+	step = &undo->steps[undo->pos++];
 
+	for (start = 0; start < step->len; start += pad + 2 * sizeof size) {
+		memcpy(&size, step->buf + start, sizeof size);
+		pad = (size + sizeof size - 1) / sizeof size * sizeof size;
+		(undo->apply)(undo->data, step->buf + start + sizeof size,
+		    size, 1);
+	}
+	undo->version = util_next_version();
+	trim_memory(undo, undo->pos - 1);
 	return (1);
 }
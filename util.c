@@ -142,6 +142,18 @@ util_next_line(char *buffer, FILE *fp)
 	return (buffer);
 }
 
+/*
+ * Versions come from one counter, so two objects never share a version
+ * unless one is a copy of the other.
+ */
+version_t
+util_next_version(void)
+{
+	static version_t version;
+
+	return (++version);
+}
+
 static void
 verrorbox(const char *fmt, va_list ap)
 {
@@ -16,14 +16,83 @@
 
 #include "vimol.h"
 
+/* screen positions of visible atoms, shared by all render passes */
+struct proj {
+	int n, nalloc;
+	int *idx;           /* visible atoms */
+	vec_t *xyz;         /* their coordinates */
+	double *x, *y, *z;  /* their screen coordinates and depth */
+	int nslot;
+	int *slot;          /* position of an atom in the above, -1 if hidden */
+	version_t camera, coords, visible, topology;
+};
+
+/* atoms and bonds in back to front order, buffers kept between frames */
+struct zsort {
+	int nalloc;
+	unsigned *key, *keytmp;
+	int *item, *itemtmp;
+	int nbonds, nbondalloc;
+	int *bonds;         /* slots of both ends and type of each bond */
+};
+
+struct segment {
+	double x1, y1, x2, y2;
+	int key;            /* atom type times four plus bond type */
+};
+
+/* primitives grouped by color, buffers kept between frames */
+struct batch {
+	int nsegs, nsegalloc;
+	struct segment *segs, *segtmp;
+	int ncount;
+	int *count;
+	int natomalloc;
+	int *atoms;
+};
+
+/* largest disc radius in pixels to keep a sprite for */
+#define MAX_SPRITE_RADIUS 64.0
+#define MAX_SPRITES 64
+
+struct sprite {
+	color_t color;
+	double radius;      /* in pixels */
+	int size;
+	cairo_surface_t *surface;
+};
+
+/* pre-drawn discs, valid for one zoom and atom size */
+struct sprites {
+	int n;
+	struct sprite data[MAX_SPRITES];
+	double zoom, atomsize;
+};
+
 struct view {
 	char *path;
 	struct camera *camera;
 	struct undo *undo;
+	struct proj proj;
+	struct zsort zsort;
+	struct batch batch;
+	struct sprites sprites;
+	struct raster *raster;
+	int use_raster;         /* draw the scene with raster, not cairo */
+	double xmin, ymin, xmax, ymax;  /* drawing area in scene coordinates */
+	int is_periodic;        /* bonds may cross the unit cell */
+	int is_lod;             /* draw a simplified scene while moving */
+	Uint32 movetime;        /* when the camera last changed */
+	Uint32 frametime;       /* duration of the last full quality frame */
+	version_t lodcamera;
+	int ncolors;
+	color_t *colors;        /* atom colors by type */
+	int *hascolor;
+	version_t colorversion;
 };
 
 static color_t
-get_atom_color(const char *name)
+find_atom_color(const char *name)
 {
 	char tag[BUFSIZ], *ptr;
 
@@ -38,45 +107,435 @@ get_atom_color(const char *name)
 	return (settings_get_color("color-x"));
 }
 
+/* colors are looked up once per atom type until color settings change */
 static void
-render_atoms(struct view *view, cairo_t *cairo)
+update_colors(struct view *view)
 {
+	if (view->colorversion == settings_get_prefix_version("color-"))
+		return;
+
+	if (view->ncolors > 0)
+		memset(view->hascolor, 0,
+		    view->ncolors * sizeof *view->hascolor);
+	view->colorversion = settings_get_prefix_version("color-");
+}
+
+/* make sure the color of an atom is in the table, return its index */
+static int
+resolve_color(struct view *view, struct sys *sys, int idx)
+{
+	int type, n;
+
+	type = sys_get_atom_type(sys, idx);
+
+	if (type >= view->ncolors) {
+		n = type + 1;
+		view->colors = xrealloc(view->colors,
+		    n * sizeof *view->colors);
+		view->hascolor = xrealloc(view->hascolor,
+		    n * sizeof *view->hascolor);
+		memset(view->hascolor + view->ncolors, 0,
+		    (n - view->ncolors) * sizeof *view->hascolor);
+		view->ncolors = n;
+	}
+	if (!view->hascolor[type]) {
+		view->colors[type] =
+		    find_atom_color(sys_get_atom_name(sys, idx));
+		view->hascolor[type] = 1;
+	}
+	return (type);
+}
+
+static void
+free_proj(struct proj *proj)
+{
+	free(proj->idx);
+	free(proj->xyz);
+	free(proj->x);
+	free(proj->y);
+	free(proj->z);
+	free(proj->slot);
+}
+
+/* project visible atoms unless nothing they depend on has changed */
+static void
+update_proj(struct view *view)
+{
+	struct proj *proj = &view->proj;
 	struct sys *sys;
 	struct sel *visible;
-	color_t color;
-	vec_t xyz;
-	point_t pos;
-	double size;
-	int idx;
+	int i, k, n;
 
-	size = settings_get_double("atom-size") / 2;
 	sys = view_get_sys(view);
 	visible = view_get_visible(view);
 
+	if (proj->camera == camera_get_version(view->camera) &&
+	    proj->coords == sys_get_xyz_version(sys) &&
+	    proj->visible == sys_get_visible_version(sys) &&
+	    proj->topology == sys_get_topology_version(sys))
+		return;
+
+	n = sel_get_count(visible);
+	if (n > proj->nalloc) {
+		proj->nalloc = n;
+		proj->idx = xrealloc(proj->idx, n * sizeof *proj->idx);
+		proj->xyz = xrealloc(proj->xyz, n * sizeof *proj->xyz);
+		proj->x = xrealloc(proj->x, n * sizeof *proj->x);
+		proj->y = xrealloc(proj->y, n * sizeof *proj->y);
+		proj->z = xrealloc(proj->z, n * sizeof *proj->z);
+	}
+	proj->n = n;
+	proj->nslot = sys_get_atom_count(sys);
+	proj->slot = xrealloc(proj->slot, (proj->nslot + 1) *
+	    sizeof *proj->slot);
+	for (i = 0; i < proj->nslot; i++)
+		proj->slot[i] = -1;
+
+	k = 0;
 	sel_iter_start(visible);
+	while (sel_iter_next(visible, &i)) {
+		proj->idx[k] = i;
+		proj->xyz[k] = sys_get_atom_xyz(sys, i);
+		proj->slot[i] = k++;
+	}
+	camera_transform_many(view->camera, n, proj->xyz, proj->x, proj->y,
+	    proj->z);
 
-	while (sel_iter_next(visible, &idx)) {
-		xyz = sys_get_atom_xyz(sys, idx);
-		pos = camera_transform(view->camera, xyz);
+	proj->camera = camera_get_version(view->camera);
+	proj->coords = sys_get_xyz_version(sys);
+	proj->visible = sys_get_visible_version(sys);
+	proj->topology = sys_get_topology_version(sys);
+}
+
+static void
+free_zsort(struct zsort *zsort)
+{
+	free(zsort->key);
+	free(zsort->keytmp);
+	free(zsort->item);
+	free(zsort->itemtmp);
+	free(zsort->bonds);
+}
+
+/*
+ * Stable LSD radix sort of items by 32-bit keys, a byte per pass.  Passes
+ * where all keys share the byte are skipped.
+ */
+static void
+radix_sort(struct zsort *zsort, int n)
+{
+	unsigned *key, *keytmp, *swapkey;
+	int *item, *itemtmp, *swapitem;
+	int count[256], shift, i, b, sum, tmp;
+
+	key = zsort->key;
+	keytmp = zsort->keytmp;
+	item = zsort->item;
+	itemtmp = zsort->itemtmp;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof count);
+		for (i = 0; i < n; i++)
+			count[(key[i] >> shift) & 0xff]++;
+		if (n == 0 || count[(key[0] >> shift) & 0xff] == n)
+			continue;
+		for (b = 0, sum = 0; b < 256; b++) {
+			tmp = count[b];
+			count[b] = sum;
+			sum += tmp;
+		}
+		for (i = 0; i < n; i++) {
+			b = (key[i] >> shift) & 0xff;
+			keytmp[count[b]] = key[i];
+			itemtmp[count[b]++] = item[i];
+		}
+		swapkey = key, key = keytmp, keytmp = swapkey;
+		swapitem = item, item = itemtmp, itemtmp = swapitem;
+	}
+	if (item != zsort->item)
+		memcpy(zsort->item, item, n * sizeof *item);
+}
+
+static void
+free_batch(struct batch *batch)
+{
+	free(batch->segs);
+	free(batch->segtmp);
+	free(batch->count);
+	free(batch->atoms);
+}
+
+static void
+grow_batch(struct batch *batch, int ncount, int natoms)
+{
+	if (ncount > batch->ncount) {
+		batch->ncount = ncount;
+		batch->count = xrealloc(batch->count,
+		    ncount * sizeof *batch->count);
+	}
+	if (natoms > batch->natomalloc) {
+		batch->natomalloc = natoms;
+		batch->atoms = xrealloc(batch->atoms,
+		    natoms * sizeof *batch->atoms);
+	}
+}
+
+static void
+clear_sprites(struct sprites *sprites)
+{
+	int i;
+
+	for (i = 0; i < sprites->n; i++)
+		cairo_surface_destroy(sprites->data[i].surface);
+	sprites->n = 0;
+}
+
+static void
+update_sprites(struct view *view, double zoom)
+{
+	struct sprites *sprites = &view->sprites;
+	double atomsize;
+
+	atomsize = settings_get_double("atom-size");
+
+	if (sprites->zoom != zoom || sprites->atomsize != atomsize) {
+		clear_sprites(sprites);
+		sprites->zoom = zoom;
+		sprites->atomsize = atomsize;
+	}
+}
+
+/* find or draw a disc sprite, NULL if the disc is too big or too small */
+static struct sprite *
+get_sprite(struct view *view, color_t color, double radius)
+{
+	struct sprites *sprites = &view->sprites;
+	struct sprite *sprite;
+	cairo_t *cairo;
+	int i;
+
+	if (radius < 0.5 || radius > MAX_SPRITE_RADIUS)
+		return (NULL);
+
+	for (i = 0; i < sprites->n; i++) {
+		sprite = sprites->data + i;
+		if (sprite->radius == radius && sprite->color.r == color.r &&
+		    sprite->color.g == color.g && sprite->color.b == color.b)
+			return (sprite);
+	}
+	if (sprites->n == MAX_SPRITES)
+		clear_sprites(sprites);
+
+	sprite = sprites->data + sprites->n;
+	sprite->color = color;
+	sprite->radius = radius;
+	sprite->size = 2 * (int)ceil(radius) + 2;
+	sprite->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+	    sprite->size, sprite->size);
+	if (cairo_surface_status(sprite->surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(sprite->surface);
+		return (NULL);
+	}
+	cairo = cairo_create(sprite->surface);
+	cairo_set_source_rgb(cairo, color.r, color.g, color.b);
+	cairo_arc(cairo, sprite->size / 2, sprite->size / 2, radius,
+	    0, 2 * PI);
+	cairo_fill(cairo);
+	cairo_destroy(cairo);
+	sprites->n++;
+
+	return (sprite);
+}
+
+/*
+ * Decide whether this frame is drawn simplified.  That is the case while
+ * the camera keeps changing and a full frame is too slow, judged by the
+ * number of atoms or by how long the last full frame took.
+ */
+static void
+update_lod(struct view *view)
+{
+	version_t version;
+	Uint32 now;
+	int idle;
+
+	now = SDL_GetTicks();
+	version = camera_get_version(view->camera);
+
+	if (version != view->lodcamera) {
+		view->lodcamera = version;
+		view->movetime = now;
+	}
+	idle = settings_get_int("lod-idle-time");
+	view->is_lod = idle > 0 && now - view->movetime < (Uint32)idle &&
+	    (view->proj.n >= settings_get_int("lod-atom-count") ||
+	    (int)view->frametime > settings_get_int("lod-frame-time"));
+}
 
-		if (cairo_in_clip(cairo, pos.x, pos.y)) {
-			color = get_atom_color(sys_get_atom_name(sys, idx));
-			cairo_set_source_rgb(cairo, color.r, color.g, color.b);
-			cairo_arc(cairo, pos.x, pos.y, size, 0, 2 * PI);
+/*
+ * Draw discs at the given projection slots.  Discs are copied from a
+ * sprite at whole pixel offsets when one is available.  Simplified
+ * frames draw squares instead.
+ */
+static void
+draw_discs(struct view *view, cairo_t *cairo, color_t color, double size,
+    const int *slots, int n)
+{
+	struct proj *proj = &view->proj;
+	struct sprite *sprite;
+	cairo_matrix_t m;
+	double x, y;
+	int i, k;
+
+	cairo_get_matrix(cairo, &m);
+
+	if (view->use_raster) {
+		for (i = 0; i < n; i++) {
+			x = proj->x[slots[i]];
+			y = proj->y[slots[i]];
+			cairo_matrix_transform_point(&m, &x, &y);
+			raster_disc(view->raster, x, y, size * m.xx, color);
+		}
+		return;
+	}
+	if (view->is_lod) {
+		cairo_set_source_rgb(cairo, color.r, color.g, color.b);
+		for (i = 0; i < n; i++) {
+			k = slots[i];
+			cairo_rectangle(cairo, proj->x[k] - size / 2,
+			    proj->y[k] - size / 2, size, size);
+		}
+		cairo_fill(cairo);
+		return;
+	}
+	if ((sprite = get_sprite(view, color, size * m.xx)) == NULL) {
+		cairo_set_source_rgb(cairo, color.r, color.g, color.b);
+		for (i = 0; i < n; i++) {
+			k = slots[i];
+			if (cairo_in_clip(cairo, proj->x[k], proj->y[k])) {
+				cairo_new_sub_path(cairo);
+				cairo_arc(cairo, proj->x[k], proj->y[k], size,
+				    0, 2 * PI);
+			}
+		}
+		cairo_fill(cairo);
+		return;
+	}
+
+	cairo_save(cairo);
+	cairo_identity_matrix(cairo);
+
+	for (i = 0; i < n; i++) {
+		k = slots[i];
+		x = proj->x[k];
+		y = proj->y[k];
+		cairo_matrix_transform_point(&m, &x, &y);
+		if (cairo_in_clip(cairo, x, y)) {
+			x = floor(x - sprite->size / 2 + 0.5);
+			y = floor(y - sprite->size / 2 + 0.5);
+			cairo_set_source_surface(cairo, sprite->surface, x, y);
+			cairo_rectangle(cairo, x, y, sprite->size,
+			    sprite->size);
 			cairo_fill(cairo);
 		}
 	}
+	cairo_restore(cairo);
 }
 
 static void
-draw_bond(cairo_t *cairo, int type, double size, point_t p1, point_t p2,
-    color_t clr1, color_t clr2)
+render_atom(struct view *view, cairo_t *cairo, int k, double size)
 {
-	point_t dp, mp;
+	color_t color;
+
+	color = view->colors[resolve_color(view, view_get_sys(view),
+	    view->proj.idx[k])];
+	draw_discs(view, cairo, color, size, &k, 1);
+}
+
+/*
+ * Draw visible atoms in index order with one fill for each run of atoms of
+ * the same color.  If group-colors is set, atoms are grouped by color first
+ * so that each color is filled once.
+ */
+static void
+render_atoms(struct view *view, cairo_t *cairo)
+{
+	struct proj *proj = &view->proj;
+	struct batch *batch = &view->batch;
+	struct sys *sys;
+	double size;
+	int i, k, t, *count;
+
+	size = settings_get_double("atom-size") / 2;
+	sys = view_get_sys(view);
+
+	for (k = 0; k < proj->n; k++)
+		resolve_color(view, sys, proj->idx[k]);
+	grow_batch(batch, view->ncolors + 1, proj->n);
+
+	if (!settings_get_bool("group-colors")) {
+		for (i = 0; i < proj->n; i = k) {
+			t = sys_get_atom_type(sys, proj->idx[i]);
+			for (k = i; k < proj->n &&
+			    sys_get_atom_type(sys, proj->idx[k]) == t; k++)
+				batch->atoms[k] = k;
+			draw_discs(view, cairo, view->colors[t], size,
+			    batch->atoms + i, k - i);
+		}
+		return;
+	}
+
+	count = batch->count;
+	memset(count, 0, (view->ncolors + 1) * sizeof *count);
+
+	for (k = 0; k < proj->n; k++)
+		count[sys_get_atom_type(sys, proj->idx[k]) + 1]++;
+	for (t = 0; t < view->ncolors; t++)
+		count[t + 1] += count[t];
+	for (k = 0; k < proj->n; k++)
+		batch->atoms[count[sys_get_atom_type(sys, proj->idx[k])]++] = k;
+
+	for (i = 0, t = 0; t < view->ncolors; t++) {
+		if (i == count[t])
+			continue;
+		draw_discs(view, cairo, view->colors[t], size,
+		    batch->atoms + i, count[t] - i);
+		i = count[t];
+	}
+}
+
+static void
+add_segment(struct batch *batch, point_t p1, point_t p2, int type)
+{
+	struct segment *seg;
+
+	if (batch->nsegs == batch->nsegalloc) {
+		batch->nsegalloc = batch->nsegalloc ?
+		    2 * batch->nsegalloc : 256;
+		batch->segs = xrealloc(batch->segs,
+		    batch->nsegalloc * sizeof *batch->segs);
+		batch->segtmp = xrealloc(batch->segtmp,
+		    batch->nsegalloc * sizeof *batch->segtmp);
+	}
+	seg = batch->segs + batch->nsegs++;
+	seg->x1 = p1.x;
+	seg->y1 = p1.y;
+	seg->x2 = p2.x;
+	seg->y2 = p2.y;
+	seg->key = 4 * type;
+}
+
+/* queue the lines of a bond, each half in the color of its atom type */
+static void
+add_bond_lines(struct view *view, int type, double size, point_t p1,
+    point_t p2, int t1, int t2)
+{
+	struct batch *batch = &view->batch;
+	point_t dp, mp, q1, q2;
 	double r;
-	int k;
+	int k, n;
 
-	assert(type > 0);
+	assert(type > 0 && type < 4);
 
 	dp.x = p1.y - p2.y;
 	dp.y = p2.x - p1.x;
@@ -92,70 +551,267 @@ draw_bond(cairo_t *cairo, int type, double size, point_t p1, point_t p2,
 	p2.x -= dp.x * (type - 1) / 2;
 	p2.y -= dp.y * (type - 1) / 2;
 
-	cairo_set_line_width(cairo, size / type);
+	n = batch->nsegs;
 
 	for (k = 0; k < type; k++) {
-		mp.x = (p1.x + p2.x) / 2;
-		mp.y = (p1.y + p2.y) / 2;
+		q1.x = p1.x + k * dp.x;
+		q1.y = p1.y + k * dp.y;
+		q2.x = p2.x + k * dp.x;
+		q2.y = p2.y + k * dp.y;
+		mp.x = (q1.x + q2.x) / 2;
+		mp.y = (q1.y + q2.y) / 2;
+		add_segment(batch, q1, mp, t1);
+		add_segment(batch, q2, mp, t2);
+	}
+	/* the key also holds the line count which sets the width */
+	for (; n < batch->nsegs; n++)
+		batch->segs[n].key += type;
+}
 
-		cairo_set_source_rgb(cairo, clr1.r, clr1.g, clr1.b);
-		cairo_move_to(cairo, p1.x, p1.y);
-		cairo_line_to(cairo, mp.x, mp.y);
-		cairo_stroke(cairo);
+/*
+ * Stroke queued lines, one path for each run of equal keys.  If sorted is
+ * set, lines are grouped by key first so that each color and width is
+ * stroked once.
+ */
+static void
+flush_segments(struct view *view, cairo_t *cairo, double size, int sorted)
+{
+	struct batch *batch = &view->batch;
+	struct segment *segs, *seg;
+	cairo_matrix_t m;
+	color_t color;
+	double x1, y1, x2, y2;
+	int i, key, nkeys;
+
+	segs = batch->segs;
+
+	if (view->use_raster) {
+		cairo_get_matrix(cairo, &m);
+		for (i = 0; i < batch->nsegs; i++) {
+			seg = segs + i;
+			x1 = seg->x1, y1 = seg->y1;
+			x2 = seg->x2, y2 = seg->y2;
+			cairo_matrix_transform_point(&m, &x1, &y1);
+			cairo_matrix_transform_point(&m, &x2, &y2);
+			raster_line(view->raster, x1, y1, x2, y2,
+			    size / (seg->key % 4) * m.xx,
+			    view->colors[seg->key / 4]);
+		}
+		batch->nsegs = 0;
+		return;
+	}
+
+	if (sorted) {
+		nkeys = 4 * view->ncolors;
+		grow_batch(batch, nkeys + 1, 0);
+		memset(batch->count, 0, (nkeys + 1) * sizeof *batch->count);
+		for (i = 0; i < batch->nsegs; i++)
+			batch->count[segs[i].key + 1]++;
+		for (key = 0; key < nkeys; key++)
+			batch->count[key + 1] += batch->count[key];
+		for (i = 0; i < batch->nsegs; i++)
+			batch->segtmp[batch->count[segs[i].key]++] = segs[i];
+		segs = batch->segtmp;
+	}
 
-		cairo_set_source_rgb(cairo, clr2.r, clr2.g, clr2.b);
-		cairo_move_to(cairo, p2.x, p2.y);
-		cairo_line_to(cairo, mp.x, mp.y);
+	for (i = 0; i < batch->nsegs; ) {
+		key = segs[i].key;
+		color = view->colors[key / 4];
+		cairo_set_source_rgb(cairo, color.r, color.g, color.b);
+		cairo_set_line_width(cairo, size / (key % 4));
+		for (; i < batch->nsegs && segs[i].key == key; i++) {
+			seg = segs + i;
+			cairo_move_to(cairo, seg->x1, seg->y1);
+			cairo_line_to(cairo, seg->x2, seg->y2);
+		}
 		cairo_stroke(cairo);
+	}
+	batch->nsegs = 0;
+}
+
+static int
+in_view(struct view *view, point_t p)
+{
+	return (p.x >= view->xmin && p.x <= view->xmax &&
+	    p.y >= view->ymin && p.y <= view->ymax);
+}
+
+/* queue a bond between the atoms in projection slots k and l */
+static void
+render_bond(struct view *view, int k, int l, int type, double size)
+{
+	struct proj *proj = &view->proj;
+	struct sys *sys;
+	point_t p1, p2, m1, m2;
+	vec_t xyz1, xyz2, img;
+	int i, j, t1, t2;
+
+	sys = view_get_sys(view);
+	i = proj->idx[k];
+	j = proj->idx[l];
+	xyz1 = proj->xyz[k];
+	xyz2 = proj->xyz[l];
+	p1.x = proj->x[k];
+	p1.y = proj->y[k];
+	p2.x = proj->x[l];
+	p2.y = proj->y[l];
+
+	if (!in_view(view, p1) && !in_view(view, p2))
+		return;
 
-		p1.x += dp.x;
-		p1.y += dp.y;
+	t1 = resolve_color(view, sys, i);
+	t2 = resolve_color(view, sys, j);
 
-		p2.x += dp.x;
-		p2.y += dp.y;
+	if (!view->is_periodic) {
+		add_bond_lines(view, type, size, p1, p2, t1, t2);
+		return;
+	}
+	img = sys_get_atom_image(sys, j, xyz1);
+	if (vec_distsq(&img, &xyz2) == 0.0) {
+		add_bond_lines(view, type, size, p1, p2, t1, t2);
+		return;
 	}
+
+	/* bond across the cell, draw halves to the images */
+	m2 = camera_transform(view->camera, img);
+	img = sys_get_atom_image(sys, i, xyz2);
+	m1 = camera_transform(view->camera, img);
+	m2.x = (p1.x + m2.x) / 2;
+	m2.y = (p1.y + m2.y) / 2;
+	m1.x = (p2.x + m1.x) / 2;
+	m1.y = (p2.y + m1.y) / 2;
+	add_bond_lines(view, type, size, p1, m2, t1, t1);
+	add_bond_lines(view, type, size, p2, m1, t2, t2);
 }
 
+/* draw visible bonds, grouped by color and bond type with group-colors */
 static void
 render_bonds(struct view *view, cairo_t *cairo)
 {
-	struct sys *sys;
+	struct proj *proj = &view->proj;
 	struct graph *graph;
 	struct graphedge *edge;
-	struct sel *visible;
-	point_t p1, p2;
-	color_t clr1, clr2;
 	double size;
-	int i, j, type;
+	int i, j, k, l;
 
 	size = settings_get_double("bond-size");
-	sys = view_get_sys(view);
 	graph = view_get_graph(view);
-	visible = view_get_visible(view);
 
-	sel_iter_start(visible);
-	while (sel_iter_next(visible, &i)) {
+	for (k = 0; k < proj->n; k++) {
+		i = proj->idx[k];
 		for (edge = graph_get_edges(graph, i); edge;
 		     edge = graph_edge_next(edge)) {
-			type = graph_edge_get_type(edge);
 			j = graph_edge_j(edge);
 
-			if (i > j || !sel_selected(visible, j))
+			if (i > j || (l = proj->slot[j]) == -1)
 				continue;
 
-			p1 = camera_transform(view->camera,
-			    sys_get_atom_xyz(sys, i));
-			p2 = camera_transform(view->camera,
-			    sys_get_atom_xyz(sys, j));
+			render_bond(view, k, l, graph_edge_get_type(edge),
+			    size);
+		}
+	}
+	flush_segments(view, cairo, size, settings_get_bool("group-colors"));
+}
+
+static void
+collect_bonds(struct view *view)
+{
+	struct proj *proj = &view->proj;
+	struct zsort *zsort = &view->zsort;
+	struct graph *graph;
+	struct graphedge *edge;
+	int i, j, k, l, *b;
+
+	graph = view_get_graph(view);
+	zsort->nbonds = 0;
+
+	for (k = 0; k < proj->n; k++) {
+		i = proj->idx[k];
+		for (edge = graph_get_edges(graph, i); edge;
+		     edge = graph_edge_next(edge)) {
+			j = graph_edge_j(edge);
 
-			if (!cairo_in_clip(cairo, p1.x, p1.y) &&
-			    !cairo_in_clip(cairo, p2.x, p2.y))
+			if (i > j || (l = proj->slot[j]) == -1)
 				continue;
 
-			clr1 = get_atom_color(sys_get_atom_name(sys, i));
-			clr2 = get_atom_color(sys_get_atom_name(sys, j));
+			if (zsort->nbonds == zsort->nbondalloc) {
+				zsort->nbondalloc = zsort->nbondalloc ?
+				    2 * zsort->nbondalloc : 64;
+				zsort->bonds = xrealloc(zsort->bonds,
+				    3 * zsort->nbondalloc *
+				    sizeof *zsort->bonds);
+			}
+			b = zsort->bonds + 3 * zsort->nbonds++;
+			b[0] = k;
+			b[1] = l;
+			b[2] = graph_edge_get_type(edge);
+		}
+	}
+}
+
+/*
+ * Draw atoms and bonds from back to front.  Bonds are placed by the depth
+ * of their middle and go before atoms at the same depth.
+ */
+static void
+render_depth_sorted(struct view *view, cairo_t *cairo)
+{
+	struct proj *proj = &view->proj;
+	struct zsort *zsort = &view->zsort;
+	double zmin, zmax, scale, z, atomsize, bondsize;
+	int i, k, n, nbonds, natoms, *b;
+
+	nbonds = 0;
+	natoms = settings_get_bool("atom-visible") ? proj->n : 0;
+	if (settings_get_bool("bond-visible")) {
+		collect_bonds(view);
+		nbonds = zsort->nbonds;
+	}
 
-			draw_bond(cairo, type, size, p1, p2, clr1, clr2);
+	n = nbonds + natoms;
+	if (n > zsort->nalloc) {
+		zsort->nalloc = n;
+		zsort->key = xrealloc(zsort->key, n * sizeof *zsort->key);
+		zsort->keytmp = xrealloc(zsort->keytmp,
+		    n * sizeof *zsort->keytmp);
+		zsort->item = xrealloc(zsort->item, n * sizeof *zsort->item);
+		zsort->itemtmp = xrealloc(zsort->itemtmp,
+		    n * sizeof *zsort->itemtmp);
+	}
+
+	zmin = zmax = 0.0;
+	for (k = 0; k < proj->n; k++) {
+		if (k == 0 || proj->z[k] < zmin)
+			zmin = proj->z[k];
+		if (k == 0 || proj->z[k] > zmax)
+			zmax = proj->z[k];
+	}
+	/* farthest first, keys are scaled to the full unsigned range */
+	scale = zmax > zmin ? 4294967295.0 / (zmax - zmin) : 0.0;
+
+	for (i = 0; i < nbonds; i++) {
+		b = zsort->bonds + 3 * i;
+		z = (proj->z[b[0]] + proj->z[b[1]]) / 2;
+		zsort->key[i] = (unsigned)((zmax - z) * scale);
+		zsort->item[i] = proj->n + i;
+	}
+	for (k = 0; k < natoms; k++) {
+		zsort->key[nbonds + k] = (unsigned)((zmax - proj->z[k]) * scale);
+		zsort->item[nbonds + k] = k;
+	}
+	radix_sort(zsort, n);
+
+	atomsize = settings_get_double("atom-size") / 2;
+	bondsize = settings_get_double("bond-size");
+
+	for (i = 0; i < n; i++) {
+		k = zsort->item[i];
+		if (k < proj->n) {
+			render_atom(view, cairo, k, atomsize);
+		} else {
+			b = zsort->bonds + 3 * (k - proj->n);
+			render_bond(view, b[0], b[1], b[2], bondsize);
+			flush_segments(view, cairo, bondsize, 0);
 		}
 	}
 }
@@ -198,12 +854,10 @@ render_origin(struct view *view, cairo_t *cairo)
 static void
 render_ids(struct view *view, cairo_t *cairo)
 {
-	struct sys *sys;
-	struct sel *visible;
+	struct proj *proj = &view->proj;
 	color_t color;
-	point_t pos;
 	double size;
-	int idx;
+	int k;
 	char buf[BUFSIZ];
 	const char *font;
 
@@ -216,18 +870,10 @@ render_ids(struct view *view, cairo_t *cairo)
 	    CAIRO_FONT_WEIGHT_NORMAL);
 	cairo_set_font_size(cairo, size);
 
-	sys = view_get_sys(view);
-	visible = view_get_visible(view);
-
-	sel_iter_start(visible);
-
-	while (sel_iter_next(visible, &idx)) {
-		pos = camera_transform(view->camera,
-		    sys_get_atom_xyz(sys, idx));
-
-		if (cairo_in_clip(cairo, pos.x, pos.y)) {
-			snprintf(buf, sizeof buf, "%d", idx + 1);
-			cairo_move_to(cairo, pos.x + 6, pos.y + 10);
+	for (k = 0; k < proj->n; k++) {
+		if (cairo_in_clip(cairo, proj->x[k], proj->y[k])) {
+			snprintf(buf, sizeof buf, "%d", proj->idx[k] + 1);
+			cairo_move_to(cairo, proj->x[k] + 6, proj->y[k] + 10);
 			cairo_show_text(cairo, buf);
 		}
 	}
@@ -236,12 +882,11 @@ render_ids(struct view *view, cairo_t *cairo)
 static void
 render_names(struct view *view, cairo_t *cairo)
 {
+	struct proj *proj = &view->proj;
 	struct sys *sys;
-	struct sel *visible;
 	color_t color;
-	point_t pos;
 	double size;
-	int idx;
+	int k;
 	const char *font, *name;
 
 	color = settings_get_color("name-color");
@@ -254,17 +899,11 @@ render_names(struct view *view, cairo_t *cairo)
 	cairo_set_font_size(cairo, size);
 
 	sys = view_get_sys(view);
-	visible = view_get_visible(view);
-
-	sel_iter_start(visible);
-
-	while (sel_iter_next(visible, &idx)) {
-		pos = camera_transform(view->camera,
-		    sys_get_atom_xyz(sys, idx));
 
-		if (cairo_in_clip(cairo, pos.x, pos.y)) {
-			name = sys_get_atom_name(sys, idx);
-			cairo_move_to(cairo, pos.x + 6, pos.y - 5);
+	for (k = 0; k < proj->n; k++) {
+		if (cairo_in_clip(cairo, proj->x[k], proj->y[k])) {
+			name = sys_get_atom_name(sys, proj->idx[k]);
+			cairo_move_to(cairo, proj->x[k] + 6, proj->y[k] - 5);
 			cairo_show_text(cairo, name);
 		}
 	}
@@ -273,37 +912,27 @@ render_names(struct view *view, cairo_t *cairo)
 static void
 render_sel(struct view *view, cairo_t *cairo)
 {
-	struct sys *sys;
-	struct sel *visible;
+	struct proj *proj = &view->proj;
+	struct batch *batch = &view->batch;
 	struct sel *sel;
 	color_t color;
-	point_t pos;
 	double size;
-	int idx;
+	int idx, k, n;
 
 	color = settings_get_color("selection-color");
 	size = settings_get_double("selection-size") / 2;
 
-	cairo_set_source_rgb(cairo, color.r, color.g, color.b);
-
-	sys = view_get_sys(view);
-	visible = view_get_visible(view);
 	sel = view_get_sel(view);
+	grow_batch(batch, 0, proj->n);
+	n = 0;
 
 	sel_iter_start(sel);
 
-	while (sel_iter_next(sel, &idx)) {
-		if (!sel_selected(visible, idx))
-			continue;
-
-		pos = camera_transform(view->camera,
-		    sys_get_atom_xyz(sys, idx));
+	while (sel_iter_next(sel, &idx))
+		if ((k = proj->slot[idx]) != -1)
+			batch->atoms[n++] = k;
 
-		if (cairo_in_clip(cairo, pos.x, pos.y)) {
-			cairo_arc(cairo, pos.x, pos.y, size, 0, 2 * PI);
-			cairo_fill(cairo);
-		}
-	}
+	draw_discs(view, cairo, color, size, batch->atoms, n);
 }
 
 struct view *
@@ -317,11 +946,14 @@ view_create(const char *path)
 
 	view = xcalloc(1, sizeof *view);
 	view->camera = camera_create();
-	view->undo = undo_create(sys, (void *(*)(void *))sys_copy,
-	    (void (*)(void *))sys_free);
+	view->raster = raster_create();
+	view->undo = undo_create(sys,
+	    (void (*)(void *, void *, size_t, int))sys_apply_change);
+	sys_set_undo(sys, view->undo);
 
 	view_set_path(view, path);
 	view_reset(view);
+	view->lodcamera = camera_get_version(view->camera);
 
 	return (view);
 }
@@ -331,7 +963,15 @@ view_free(struct view *view)
 {
 	if (view) {
 		camera_free(view->camera);
+		sys_free(view_get_sys(view));
 		undo_free(view->undo);
+		free_proj(&view->proj);
+		free_zsort(&view->zsort);
+		free_batch(&view->batch);
+		clear_sprites(&view->sprites);
+		raster_free(view->raster);
+		free(view->colors);
+		free(view->hascolor);
 		free(view->path);
 		free(view);
 	}
@@ -397,13 +1037,19 @@ view_is_modified(struct view *view)
 int
 view_undo(struct view *view)
 {
-	return (undo_undo(view->undo));
+	if (!undo_undo(view->undo))
+		return (0);
+	sys_set_modified(view_get_sys(view), !undo_is_saved(view->undo));
+	return (1);
 }
 
 int
 view_redo(struct view *view)
 {
-	return (undo_redo(view->undo));
+	if (!undo_redo(view->undo))
+		return (0);
+	sys_set_modified(view_get_sys(view), !undo_is_saved(view->undo));
+	return (1);
 }
 
 void
@@ -412,6 +1058,12 @@ view_snapshot(struct view *view)
 	undo_snapshot(view->undo);
 }
 
+size_t
+view_get_undo_memory(struct view *view)
+{
+	return (undo_get_memory(view->undo));
+}
+
 void
 view_reset(struct view *view)
 {
@@ -462,16 +1114,44 @@ view_fit_sel(struct view *view, struct sel *sel)
 	}
 }
 
+/*
+ * Return the number of milliseconds until the view should be drawn again
+ * at full quality, or -1 if the last frame was drawn at full quality.
+ */
+int
+view_get_refresh_delay(struct view *view)
+{
+	Uint32 elapsed;
+	int idle;
+
+	if (!view->is_lod)
+		return (-1);
+
+	idle = settings_get_int("lod-idle-time");
+	elapsed = SDL_GetTicks() - view->movetime;
+
+	if (idle <= 0 || elapsed >= (Uint32)idle)
+		return (0);
+
+	return (idle - (int)elapsed);
+}
+
 void
 view_render(struct view *view, cairo_t *cairo)
 {
+	cairo_surface_t *target;
 	color_t color;
+	vec_t abc[3];
+	const char *backend;
 	int width, height;
+	Uint32 start;
 	double zoom;
 
+	start = SDL_GetTicks();
 	color = settings_get_color("bg-color");
-	width = cairo_image_surface_get_width(cairo_get_target(cairo));
-	height = cairo_image_surface_get_height(cairo_get_target(cairo));
+	target = cairo_get_target(cairo);
+	width = cairo_image_surface_get_width(target);
+	height = cairo_image_surface_get_height(target);
 	zoom = camera_get_zoom(view->camera, width, height);
 
 	cairo_reset_clip(cairo);
@@ -482,21 +1162,63 @@ view_render(struct view *view, cairo_t *cairo)
 	cairo_clip(cairo);
 	cairo_translate(cairo, width / 2, height / 2);
 	cairo_scale(cairo, zoom, zoom);
+	view->xmin = -width / 2.0 / zoom;
+	view->xmax = width / 2.0 / zoom;
+	view->ymin = -height / 2.0 / zoom;
+	view->ymax = height / 2.0 / zoom;
+	view->is_periodic = sys_get_cell(view_get_sys(view), abc);
+	update_colors(view);
+	update_proj(view);
+	update_sprites(view, zoom);
+	update_lod(view);
+
+	if (view->is_lod)
+		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_NONE);
+
+	/* with the raster backend cairo only draws text on top */
+	backend = settings_get_string("render-backend");
+	if (strcmp(backend, "auto") == 0)
+		view->use_raster =
+		    view->proj.n >= settings_get_int("raster-atom-count");
+	else
+		view->use_raster = strcmp(backend, "raster") == 0;
+	if (view->use_raster) {
+		cairo_surface_flush(target);
+		raster_set_target(view->raster,
+		    cairo_image_surface_get_data(target), width, height,
+		    cairo_image_surface_get_stride(target));
+	}
 
-	if (settings_get_bool("bond-visible"))
-		render_bonds(view, cairo);
+	if (settings_get_bool("depth-sort")) {
+		render_depth_sorted(view, cairo);
+	} else {
+		if (settings_get_bool("bond-visible"))
+			render_bonds(view, cairo);
 
-	if (settings_get_bool("atom-visible"))
-		render_atoms(view, cairo);
+		if (settings_get_bool("atom-visible"))
+			render_atoms(view, cairo);
+	}
 
 	render_sel(view, cairo);
 
+	if (view->use_raster) {
+		raster_draw(view->raster);
+		cairo_surface_mark_dirty(target);
+	}
+
 	if (settings_get_bool("origin-visible"))
 		render_origin(view, cairo);
 
+	if (view->is_lod) {
+		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_DEFAULT);
+		return;
+	}
+
 	if (settings_get_bool("name-visible"))
 		render_names(view, cairo);
 
 	if (settings_get_bool("id-visible"))
 		render_ids(view, cairo);
+
+	view->frametime = SDL_GetTicks() - start;
 }
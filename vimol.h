@@ -74,6 +74,9 @@ struct pairs;       /* dynamic array of pairs */
 
 typedef const char *tok_t; /* a tokq token */
 
+/* Change counter, unique across all objects. */
+typedef unsigned long long version_t;
+
 struct atoms;       /* atom storage */
 struct bind;        /* key-command bindings */
 struct camera;      /* an eye of a user */
@@ -81,6 +84,7 @@ struct edit;        /* string edit control */
 struct graph;       /* vertices connected with edges */
 struct graphedge;   /* edge of a graph */
 struct history;     /* command-line history management */
+struct raster;      /* scene drawing into a pixel buffer */
 struct rec;         /* command recording */
 struct sel;         /* selection of objects */
 struct spi;         /* spatial index */
@@ -95,14 +99,17 @@ struct yank;        /* copy-paste buffer */
 
 /* atoms.c */
 struct atoms *atoms_create(void);
-struct atoms *atoms_copy(struct atoms *);
 void atoms_free(struct atoms *);
 int atoms_get_frame(struct atoms *);
 void atoms_set_frame(struct atoms *, int);
 int atoms_get_frame_count(struct atoms *);
+void atoms_reserve(struct atoms *, int, int);
 void atoms_add_frame(struct atoms *);
 void atoms_add(struct atoms *, const char *, vec_t);
+void atoms_add_many(struct atoms *, int, const char **, const vec_t *);
 void atoms_remove(struct atoms *, int);
+void atoms_remove_many(struct atoms *, const int *);
+void atoms_insert_many(struct atoms *, int, const int *);
 void atoms_clear(struct atoms *);
 int atoms_get_count(struct atoms *);
 const char *atoms_get_name(struct atoms *, int);
@@ -110,6 +117,10 @@ int atoms_get_type(struct atoms *, int);
 void atoms_set_name(struct atoms *, int, const char *);
 vec_t atoms_get_xyz(struct atoms *, int);
 void atoms_set_xyz(struct atoms *, int, vec_t);
+int atoms_get_cell(struct atoms *, vec_t *);
+void atoms_set_cell(struct atoms *, const vec_t *);
+version_t atoms_get_version(struct atoms *);
+version_t atoms_get_xyz_version(struct atoms *);
 
 /* bind.c */
 struct bind *bind_create(void);
@@ -129,8 +140,11 @@ void camera_set_scale(struct camera *, double);
 double camera_get_scale(struct camera *);
 void camera_set_radius(struct camera *, double);
 double camera_get_radius(struct camera *);
+version_t camera_get_version(struct camera *);
 double camera_get_zoom(struct camera *, int, int);
 point_t camera_transform(struct camera *, vec_t);
+void camera_transform_many(struct camera *, int, const vec_t *, double *,
+    double *, double *);
 
 /* cmd.c */
 int cmd_is_valid(const char *);
@@ -166,12 +180,16 @@ int formats_save(struct atoms *, const char *);
 
 /* graph.c */
 struct graph *graph_create(void);
-struct graph *graph_copy(struct graph *);
 void graph_free(struct graph *);
 void graph_clear(struct graph *);
 void graph_vertex_add(struct graph *);
 void graph_vertex_remove(struct graph *, int);
+void graph_vertex_remove_many(struct graph *, const int *);
+void graph_vertex_insert_many(struct graph *, int, const int *);
+void graph_set_hook(struct graph *, void (*)(void *, int, int, int, int),
+    void *);
 int graph_get_vertex_count(struct graph *);
+version_t graph_get_version(struct graph *);
 int graph_get_edge_count(struct graph *, int);
 void graph_remove_vertex_edges(struct graph *, int);
 void graph_edge_create(struct graph *, int, int, int);
@@ -181,7 +199,7 @@ struct graphedge *graph_edge_find(struct graph *, int, int);
 struct graphedge *graph_edge_prev(struct graphedge *);
 struct graphedge *graph_edge_next(struct graphedge *);
 int graph_edge_get_type(struct graphedge *);
-void graph_edge_set_type(struct graphedge *, int);
+void graph_edge_set_type(struct graph *, struct graphedge *, int);
 int graph_edge_i(struct graphedge *);
 int graph_edge_j(struct graphedge *);
 
@@ -202,9 +220,25 @@ struct pairs *pairs_create(void);
 void pairs_free(struct pairs *);
 void pairs_clear(struct pairs *);
 void pairs_add(struct pairs *, int, int);
+void pairs_append(struct pairs *, struct pairs *);
 int pairs_get_count(struct pairs *);
 struct pair pairs_get(struct pairs *, int);
 
+/* pool.c */
+void pool_init(void);
+void pool_free(void);
+int pool_get_thread_count(void);
+void pool_run(void (*)(void *, int), void *, int);
+
+/* raster.c */
+struct raster *raster_create(void);
+void raster_free(struct raster *);
+void raster_set_target(struct raster *, unsigned char *, int, int, int);
+void raster_disc(struct raster *, double, double, double, color_t);
+void raster_line(struct raster *, double, double, double, double, double,
+    color_t);
+void raster_draw(struct raster *);
+
 /* rec.c */
 struct rec *rec_create(void);
 void rec_free(struct rec *);
@@ -218,15 +252,22 @@ int rec_play(struct rec *, struct state *);
 /* sel.c */
 struct sel *sel_create(int);
 struct sel *sel_copy(struct sel *);
+void sel_set_hook(struct sel *, void (*)(void *, struct sel *, int, int),
+    void *);
 void sel_free(struct sel *);
 int sel_get_size(struct sel *);
 int sel_get_count(struct sel *);
+version_t sel_get_version(struct sel *);
 void sel_expand(struct sel *);
 void sel_contract(struct sel *, int);
+void sel_contract_many(struct sel *, const int *);
+void sel_expand_many(struct sel *, int, const int *);
 void sel_add(struct sel *, int);
+void sel_insert(struct sel *, int, int);
 void sel_remove(struct sel *, int);
 void sel_all(struct sel *);
 void sel_clear(struct sel *);
+int sel_get_list(struct sel *, int *);
 int sel_selected(struct sel *, int);
 void sel_iter_start(struct sel *);
 int sel_iter_next(struct sel *, int *);
@@ -246,18 +287,29 @@ double settings_get_double(const char *);
 int settings_get_bool(const char *);
 const char *settings_get_string(const char *);
 color_t settings_get_color(const char *);
+version_t settings_get_version(void);
+version_t settings_get_prefix_version(const char *);
+version_t settings_get_other_version(const char *);
 int settings_set(const char *, const char *);
 
 /* spi.c */
 struct spi *spi_create(void);
 void spi_free(struct spi *);
+void spi_set_lattice(struct spi *, const vec_t *);
 void spi_add_point(struct spi *, vec_t);
+void spi_set_point(struct spi *, int, vec_t);
+void spi_remove_point(struct spi *, int);
+void spi_remove_many(struct spi *, const int *);
 int spi_get_point_count(struct spi *);
 vec_t spi_get_point(struct spi *, int);
 void spi_clear(struct spi *);
 void spi_compute(struct spi *, double);
+void spi_compute_filter(struct spi *, double, int (*)(void *, int, int, double),
+    void *);
 int spi_get_pair_count(struct spi *);
 struct pair spi_get_pair(struct spi *, int);
+void spi_query_radius(struct spi *, vec_t, double, struct sel *);
+int spi_query_nearest(struct spi *, vec_t, int, int *);
 
 /* state.c */
 struct state *state_create(void);
@@ -286,26 +338,38 @@ const char *statusbar_get_info_text(struct statusbar *);
 void statusbar_set_info_text(struct statusbar *, const char *, ...);
 void statusbar_clear_info_text(struct statusbar *);
 void statusbar_set_cursor_pos(struct statusbar *, int);
+version_t statusbar_get_version(struct statusbar *);
 void statusbar_render(struct statusbar *, cairo_t *);
 
 /* sys.c */
 struct sys *sys_create(const char *);
-struct sys *sys_copy(struct sys *);
 void sys_free(struct sys *);
 struct graph *sys_get_graph(struct sys *);
 struct sel *sys_get_sel(struct sys *);
 struct sel *sys_get_visible(struct sys *);
+struct spi *sys_get_spi(struct sys *);
+void sys_set_undo(struct sys *, struct undo *);
+void sys_apply_change(struct sys *, void *, size_t, int);
 int sys_is_modified(struct sys *);
+void sys_set_modified(struct sys *, int);
+version_t sys_get_topology_version(struct sys *);
+version_t sys_get_xyz_version(struct sys *);
+version_t sys_get_sel_version(struct sys *);
+version_t sys_get_visible_version(struct sys *);
 int sys_get_frame(struct sys *);
 void sys_set_frame(struct sys *, int);
 int sys_get_frame_count(struct sys *);
 void sys_add_atom(struct sys *, const char *, vec_t);
+void sys_add_atoms(struct sys *, int, const char **, const vec_t *);
 void sys_remove_atom(struct sys *, int);
+void sys_remove_atoms(struct sys *, struct sel *);
+int sys_get_cell(struct sys *, vec_t *);
 int sys_get_atom_count(struct sys *);
 const char *sys_get_atom_name(struct sys *, int);
 int sys_get_atom_type(struct sys *, int);
 void sys_set_atom_name(struct sys *, int, const char *);
 vec_t sys_get_atom_xyz(struct sys *, int);
+vec_t sys_get_atom_image(struct sys *, int, vec_t);
 void sys_set_atom_xyz(struct sys *, int, vec_t);
 void sys_add_hydrogens(struct sys *, struct sel *);
 vec_t sys_get_sel_center(struct sys *, struct sel *);
@@ -340,10 +404,17 @@ int tokq_count(struct tokq *);
 tok_t tokq_tok(struct tokq *, int);
 
 /* undo.c */
-struct undo *undo_create(void *, void *(*)(void *), void (*)(void *));
+struct undo *undo_create(void *, void (*)(void *, void *, size_t, int));
 void undo_free(struct undo *);
 void *undo_get_data(struct undo *);
+size_t undo_get_memory(struct undo *);
+void undo_set_saved(struct undo *);
+version_t undo_get_version(struct undo *);
+int undo_is_saved(struct undo *);
 void undo_snapshot(struct undo *);
+void undo_record(struct undo *, const void *, size_t);
+void undo_record_state(struct undo *, const void *, size_t);
+void *undo_resize_state(struct undo *, size_t);
 int undo_undo(struct undo *);
 int undo_redo(struct undo *);
 
@@ -356,6 +427,7 @@ int string_has_suffix(const char *, const char *);
 int util_file_exists(const char *);
 const char *util_basename(const char *);
 char *util_next_line(char *, FILE *);
+version_t util_next_version(void);
 void warn(const char *, ...);
 void fatal(const char *, ...) __dead;
 
@@ -374,9 +446,11 @@ int view_is_modified(struct view *);
 int view_undo(struct view *);
 int view_redo(struct view *);
 void view_snapshot(struct view *);
+size_t view_get_undo_memory(struct view *);
 void view_reset(struct view *);
 void view_center_sel(struct view *, struct sel *);
 void view_fit_sel(struct view *, struct sel *);
+int view_get_refresh_delay(struct view *);
 void view_render(struct view *, cairo_t *);
 
 /* xmalloc.c */
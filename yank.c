@@ -60,6 +60,7 @@ yank_copy(struct yank *yank, struct sys *sys, struct sel *sel)
 	map = xcalloc(sys_get_atom_count(sys), sizeof *map);
 
 	atoms_clear(yank->atoms);
+	atoms_reserve(yank->atoms, sel_get_count(sel), 1);
 	graph_clear(yank->graph);
 
 	j = 0;
@@ -99,17 +100,22 @@ void
 yank_paste(struct yank *yank, struct sys *sys)
 {
 	struct graphedge *edge;
-	const char *name;
-	vec_t xyz;
-	int i, j, n, type;
+	const char **names;
+	vec_t *xyz;
+	int i, j, n, count, type;
 
 	n = sys_get_atom_count(sys);
+	count = atoms_get_count(yank->atoms);
+	names = xcalloc(count, sizeof *names);
+	xyz = xcalloc(count, sizeof *xyz);
 
-	for (i = 0; i < atoms_get_count(yank->atoms); i++) {
-		name = atoms_get_name(yank->atoms, i);
-		xyz = atoms_get_xyz(yank->atoms, i);
-		sys_add_atom(sys, name, xyz);
+	for (i = 0; i < count; i++) {
+		names[i] = atoms_get_name(yank->atoms, i);
+		xyz[i] = atoms_get_xyz(yank->atoms, i);
 	}
+	sys_add_atoms(sys, count, names, xyz);
+	free(names);
+	free(xyz);
 
 	for (i = 0; i < graph_get_vertex_count(yank->graph); i++) {
 		edge = graph_get_edges(yank->graph, i);